@@ -1,9 +1,11 @@
 #include "nrf_sphero/sphero.hpp"
 #include "nrf_sphero/sphero_scanner.hpp"
+#include "nrf_sphero/swarm.hpp"
 #include <zephyr/drivers/uart.h>
 #include <zephyr/kernel.h>
 // Logging
 #include <cstdlib>
+#include <string>
 #include <zephyr/logging/log.h>
 #include <zephyr/timing/timing.h>
 
@@ -280,6 +282,113 @@ std::vector<std::vector<uint8_t>> frame = {
 
 std::vector<RGBColor> palette = { RGBColor(0, 0, 0), RGBColor(255, 255, 255) };
 
+// Heading correction of the sphero being matched. Runs from response callbacks so UART keeps being served
+
+#define CALIBRATION_SETTLE_MS 600
+
+struct Calibration {
+    /** Sphero being calibrated, nullptr while idle */
+    std::shared_ptr<Sphero> sphero;
+    uint16_t heading;
+    /** Heading received while busy, calibrated once the current run finishes. A newer one replaces it */
+    std::shared_ptr<Sphero> next_sphero;
+    uint16_t next_heading;
+    struct k_spinlock lock;
+    /** Commands are sent from the system work queue since sending can wait for a TX buffer */
+    struct k_work drive_work;
+    struct k_work_delayable reset_work;
+};
+
+static Calibration calibration;
+
+static void calibration_finish(const char* result, uint8_t retries)
+{
+    LOG_DBG("Calibration %s (%d retries)", result, retries);
+
+    k_spinlock_key_t key = k_spin_lock(&calibration.lock);
+
+    calibration.sphero = calibration.next_sphero;
+    calibration.heading = calibration.next_heading;
+    calibration.next_sphero = nullptr;
+
+    bool next = calibration.sphero != nullptr;
+
+    k_spin_unlock(&calibration.lock, key);
+
+    if (next) {
+        k_work_submit(&calibration.drive_work);
+    }
+}
+
+static void calibration_aim_reset(const PacketView* packet, int err, uint8_t retries, void* context)
+{
+    if (err || packet->err != PacketError::success) {
+        LOG_ERR("Aim wasn't reset (err %d)", err);
+        calibration_finish("failed", retries);
+        return;
+    }
+
+    calibration_finish("done", retries);
+}
+
+static void calibration_reset_work_handler(struct k_work* work)
+{
+    int err = calibration.sphero->reset_aim_with_retries(calibration_aim_reset, nullptr);
+
+    if (err) {
+        LOG_ERR("Failed to reset aim (err %d)", err);
+        calibration_finish("failed", 0);
+    }
+}
+
+static void calibration_heading_applied(const PacketView* packet, int err, uint8_t retries, void* context)
+{
+    if (err || packet->err != PacketError::success) {
+        // Resetting now would calibrate against a heading that was never applied
+        LOG_ERR("Heading wasn't applied (err %d), not resetting aim", err);
+        calibration_finish("failed", retries);
+        return;
+    }
+
+    if (retries) {
+        LOG_DBG("Heading applied after %d retries", retries);
+    }
+
+    // Let the sphero finish turning before using its direction as 0°
+    k_work_schedule(&calibration.reset_work, K_MSEC(CALIBRATION_SETTLE_MS));
+}
+
+static void calibration_drive_work_handler(struct k_work* work)
+{
+    int err = calibration.sphero->drive_with_retries(0, calibration.heading, calibration_heading_applied, nullptr);
+
+    if (err) {
+        LOG_ERR("Failed to correct heading (err %d)", err);
+        calibration_finish("failed", 0);
+    }
+}
+
+static void calibration_start(std::shared_ptr<Sphero> sphero, uint16_t heading)
+{
+    k_spinlock_key_t key = k_spin_lock(&calibration.lock);
+
+    if (calibration.sphero) {
+        calibration.next_sphero = sphero;
+        calibration.next_heading = heading;
+        k_spin_unlock(&calibration.lock, key);
+
+        LOG_INF("Still calibrating, heading %d is next", heading);
+        return;
+    }
+
+    calibration.sphero = sphero;
+    calibration.heading = heading;
+
+    k_spin_unlock(&calibration.lock, key);
+
+    k_work_submit(&calibration.drive_work);
+}
+
 void handle_match_state(uart_data_t* rx, std::vector<std::shared_ptr<Sphero>>* spheros)
 {
     if (matching >= spheros->size()) {
@@ -324,18 +433,13 @@ void handle_match_state(uart_data_t* rx, std::vector<std::shared_ptr<Sphero>>* s
 
         uint16_t heading = (rx->data[2] << 8) | (rx->data[3]); // big-endian format
         LOG_DBG("Angle is: %d", heading);
-        auto response = sphero->drive_with_response(0, heading);
-
-        sphero->wait_for_response(response);
-        k_msleep(600);
-
-        sphero->reset_aim();
-        LOG_DBG("Resetted aim!");
+        // Drives, waits for the sphero to settle and resets aim without blocking
+        calibration_start(sphero, heading);
         break;
     }
 }
 
-void handle_color_state(uart_data_t* rx, std::vector<std::shared_ptr<Sphero>>* spheros)
+void handle_color_state(uart_data_t* rx, Swarm* swarm)
 {
     // data[0] is always 0x8d
     // data[1] is command byte
@@ -343,8 +447,8 @@ void handle_color_state(uart_data_t* rx, std::vector<std::shared_ptr<Sphero>>* s
     // Then we have 3 * spheros for velocities
     // Then we have the end byte
 
-    if (rx->len != 3 + (6 * spheros->size())) {
-        LOG_ERR("Recieved %d bytes, expected %d", rx->len, 3 + (6 * spheros->size()));
+    if (rx->len != 3 + (6 * swarm->size())) {
+        LOG_ERR("Recieved %d bytes, expected %d", rx->len, 3 + (6 * swarm->size()));
         return;
     }
 
@@ -353,33 +457,44 @@ void handle_color_state(uart_data_t* rx, std::vector<std::shared_ptr<Sphero>>* s
         return;
     }
 
-    // Set the state colors
-    for (int i = 0; i < spheros->size(); i++) {
+    int offset = 2 + (3 * swarm->size());
+
+    // Set the state colors and velocities on every sphero at once
+    swarm->execute([rx, offset](Sphero& sphero, size_t i) {
         auto color = RGBColor(rx->data[(i * 3) + 2], rx->data[(i * 3 + 1) + 2], rx->data[(i * 3 + 2) + 2]);
-        (*spheros)[i]->set_matrix_color(color);
-    }
 
-    int offset = 2 + (3 * spheros->size());
+        int err = sphero.set_matrix_color(color);
+
+        if (err) {
+            return err;
+        }
 
-    // Set the velocities
-    for (int i = 0; i < spheros->size(); i++) {
         uint8_t speed = rx->data[offset + (i * 3)];
         uint16_t heading = (rx->data[offset + (i * 3) + 1] << 8) | (rx->data[offset + (i * 3) + 2]); // big-endian format
         LOG_DBG("Speed is: %d, heading is: %d", speed, heading);
-        (*spheros)[i]->drive(speed, heading);
-    }
+
+        return sphero.drive(speed, heading);
+    });
 }
 
-void reset(std::vector<std::shared_ptr<Sphero>>* spheros)
+void reset(Swarm* swarm)
 {
     LOG_DBG("Resetting state!");
 
     // Clear the LED matrix on all spheros
-    for (auto sphero : *spheros) {
-        sphero->clear_matrix();
-        sphero->set_matrix_color(RGBColor(0, 0, 0));
-        sphero->set_all_leds_with_map({ { Sphero::LEDs::FRONT_BLUE, 0 }, { Sphero::LEDs::BACK_BLUE, 0 } });
-    }
+    swarm->execute([](Sphero& sphero, size_t) {
+        int err = sphero.clear_matrix();
+
+        if (!err) {
+            err = sphero.set_matrix_color(RGBColor(0, 0, 0));
+        }
+
+        if (!err) {
+            err = sphero.set_all_leds_with_map({ { Sphero::LEDs::FRONT_BLUE, 0 }, { Sphero::LEDs::BACK_BLUE, 0 } });
+        }
+
+        return err;
+    });
 
     matching_index = 0;
     state = States::IDLE;
@@ -392,7 +507,7 @@ void send_response(uint8_t* data, size_t data_size)
     tx->len = data_size + 2;
 
     tx->data[0] = 0x8d;
-    memcpy(&tx->data[1], data, sizeof(data));
+    memcpy(&tx->data[1], data, data_size);
     tx->data[tx->len - 1] = 0x0a;
 
     int err = uart_tx(uart, tx->data, tx->len, SYS_FOREVER_MS);
@@ -402,6 +517,93 @@ void send_response(uint8_t* data, size_t data_size)
     }
 }
 
+static void push_u16(std::vector<uint8_t>& data, uint16_t value)
+{
+    data.push_back(value >> 8);
+    data.push_back(value & 0xFF);
+}
+
+static void push_u32(std::vector<uint8_t>& data, uint32_t value)
+{
+    push_u16(data, value >> 16);
+    push_u16(data, value & 0xFFFF);
+}
+
+// Returns whether the statistics were sent, otherwise the request is acknowledged like any other command
+bool handle_stats_request(uart_data_t* rx, std::vector<std::shared_ptr<Sphero>>* spheros)
+{
+    // data[0] is always 0x8d
+    // data[1] is 0x20
+    // data[2] is the index of the sphero
+    // Then we have the end byte
+
+    if (rx->len != 4) {
+        LOG_ERR("Recieved %d bytes, expected 4", rx->len);
+        return false;
+    }
+
+    uint8_t index = rx->data[2];
+
+    if (index >= spheros->size()) {
+        LOG_ERR("No sphero with index %d", index);
+        return false;
+    }
+
+    auto stats = (*spheros)[index]->get_link_stats();
+
+    // All values are big-endian, like the commands from python
+    std::vector<uint8_t> data = { 0x20, index, stats.connected, static_cast<uint8_t>(stats.rssi) };
+
+    push_u32(data, stats.link.bytes_sent);
+    push_u32(data, stats.link.writes_sent);
+    push_u32(data, stats.link.write_errors);
+    push_u32(data, stats.tx_alloc_failures);
+    push_u32(data, stats.link.notifications);
+    push_u32(data, stats.link.bytes_received);
+    push_u32(data, stats.parse_errors);
+    push_u32(data, stats.rx_overflows);
+    push_u32(data, stats.srtt_ms);
+    push_u32(data, stats.rttvar_ms);
+    push_u32(data, stats.response_timeout_ms);
+    push_u32(data, stats.retries);
+    push_u32(data, stats.lost_commands);
+    push_u32(data, stats.stalls);
+    push_u32(data, stats.stall_disconnects);
+    push_u16(data, stats.link.interval);
+    push_u16(data, stats.link.latency);
+    push_u16(data, stats.link.timeout);
+    data.push_back(stats.link.tx_phy);
+    data.push_back(stats.link.rx_phy);
+    push_u16(data, stats.link.tx_queue_depth);
+    push_u16(data, stats.link.max_payload);
+    push_u16(data, stats.in_flight);
+    push_u16(data, stats.tx_bufs_free);
+
+    send_response(data.data(), data.size());
+
+    return true;
+}
+
+// Tells python which spheros are ready. Sent while waking, before the 0x10 ready message
+void send_ready_mask(Swarm* swarm)
+{
+    // data[0] is 0x11
+    // Then a bit per sphero, sphero i is bit i % 8 of byte i / 8
+    std::vector<uint8_t> data = { 0x11 };
+
+    for (size_t i = 0; i < swarm->size(); i++) {
+        if (i % 8 == 0) {
+            data.push_back(0);
+        }
+
+        if ((*swarm)[i]->is_ready()) {
+            data.back() |= 1 << (i % 8);
+        }
+    }
+
+    send_response(data.data(), data.size());
+}
+
 // Function to convert a range of uint8_t array to std::string
 std::string uint8ToString(const uint8_t* data, size_t start, size_t end)
 {
@@ -421,6 +623,9 @@ int main(void)
         return 1;
     }
 
+    k_work_init(&calibration.drive_work, calibration_drive_work_handler);
+    k_work_init_delayable(&calibration.reset_work, calibration_reset_work_handler);
+
     // Get the names of the Spheros to connect to
 
     LOG_DBG("nrfSphero started. Waiting for Sphero Names...");
@@ -483,17 +688,29 @@ int main(void)
         LOG_INF("Scanning started");
     }
 
-    while (!scanner.found_all_spheros()) {
-        k_msleep(5);
+    if (scanner.wait_for_all_spheros()) {
+        LOG_DBG("Found all spheros");
+    } else {
+        for (auto& name : scanner.get_missing_spheros()) {
+            LOG_WRN("Couldn't find %s", name.c_str());
+        }
     }
 
     scanner.stop_scanning();
 
-    LOG_DBG("Found all spheros");
-
     auto spheros = scanner.get_spheros();
     LOG_INF("Found %d spheros", scanner.get_num_spheros());
 
+    Swarm swarm(spheros);
+
+    // Wake every sphero at once, telling python which are ready as they answer
+    swarm.wake(SWARM_WAKE_TIMEOUT_MS, [&swarm](size_t) { send_ready_mask(&swarm); });
+
+    LOG_INF("%d of %d spheros ready", swarm.ready_count(), swarm.size());
+
+    // The final readiness, the rest may not respond
+    send_ready_mask(&swarm);
+
     // Ready to start, tell python
     uint8_t data[] = { 0x10 };
     size_t data_size = sizeof(data) / sizeof(data[0]);
@@ -509,17 +726,23 @@ int main(void)
                 continue;
             }
 
-            if (rx->data[1] == 0x00) {
-                reset(&spheros);
+            if (rx->data[1] == 0x20) {
+                // Link statistics are the reply, no acknowledgement follows
+                if (handle_stats_request(rx, &spheros)) {
+                    k_free(rx);
+                    continue;
+                }
+            } else if (rx->data[1] == 0x00) {
+                reset(&swarm);
             } else {
                 switch (state) {
                 case States::IDLE:
                     handle_idle_state(rx);
 
                     if (state == States::SET_COLORS) {
-                        for (auto sphero : spheros) {
-                            sphero->set_matrix_color(RGBColor(255, 255, 255));
-                        }
+                        swarm.execute([](Sphero& sphero, size_t) {
+                            return sphero.set_matrix_color(RGBColor(255, 255, 255));
+                        });
                     }
 
                     break;
@@ -527,7 +750,7 @@ int main(void)
                     handle_match_state(rx, &spheros);
                     break;
                 case States::SET_COLORS:
-                    handle_color_state(rx, &spheros);
+                    handle_color_state(rx, &swarm);
                     break;
                 }
             }
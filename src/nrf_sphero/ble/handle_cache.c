@@ -0,0 +1,235 @@
+#include "handle_cache.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(handle_cache, LOG_LEVEL_DBG);
+
+/* Address type and value as hex */
+#define HANDLE_CACHE_ADDR_LEN (2 * sizeof(bt_addr_le_t))
+
+struct handle_cache_entry {
+    bool used;
+    /* Flash is behind RAM, saved (or deleted if not used) by persist_work */
+    bool dirty;
+    bt_addr_le_t addr;
+    struct bt_sphero_client_handles handles;
+};
+
+/* Written from the BT RX thread once loaded at init and read by persist_work, both under lock */
+static struct handle_cache_entry entries[HANDLE_CACHE_SIZE];
+static size_t next_evict;
+static struct k_spinlock lock;
+
+static void persist_work_handler(struct k_work* work);
+
+/* Flash writes and NVS garbage collection can take a while, so they're kept off the BT RX thread */
+static K_WORK_DEFINE(persist_work, persist_work_handler);
+
+static void key_from_addr(const bt_addr_le_t* addr, char* key, size_t len)
+{
+    size_t prefix = snprintk(key, len, HANDLE_CACHE_SETTINGS_KEY "/");
+
+    bin2hex((const uint8_t*)addr, sizeof(*addr), key + prefix, len - prefix);
+}
+
+static struct handle_cache_entry* entry_find(const bt_addr_le_t* addr)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        if (entries[i].used && bt_addr_le_cmp(&entries[i].addr, addr) == 0) {
+            return &entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct handle_cache_entry* entry_alloc(const bt_addr_le_t* addr)
+{
+    struct handle_cache_entry* entry = entry_find(addr);
+
+    if (entry) {
+        return entry;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        /* A forgotten entry is only free once it has been deleted from flash */
+        if (!entries[i].used && !entries[i].dirty) {
+            entry = &entries[i];
+            break;
+        }
+    }
+
+    /* Full, replace the oldest in RAM. It stays in flash and is loaded again after a reboot, so only an entry which
+     * has been persisted can go */
+    for (size_t i = 0; !entry && i < ARRAY_SIZE(entries); i++) {
+        if (!entries[next_evict].dirty) {
+            entry = &entries[next_evict];
+        }
+
+        next_evict = (next_evict + 1) % ARRAY_SIZE(entries);
+    }
+
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->used = true;
+    bt_addr_le_copy(&entry->addr, addr);
+
+    return entry;
+}
+
+static int handle_cache_set(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg)
+{
+    struct handle_cache_entry* entry;
+    struct bt_sphero_client_handles handles;
+    bt_addr_le_t addr;
+    ssize_t read;
+
+    if (settings_name_next(name, NULL) != HANDLE_CACHE_ADDR_LEN ||
+        hex2bin(name, HANDLE_CACHE_ADDR_LEN, (uint8_t*)&addr, sizeof(addr)) != sizeof(addr)) {
+        LOG_WRN("Ignoring invalid key %s", name);
+        return -EINVAL;
+    }
+
+    if (len != sizeof(handles)) {
+        return -EINVAL;
+    }
+
+    read = read_cb(cb_arg, &handles, sizeof(handles));
+
+    if (read != sizeof(handles)) {
+        return read < 0 ? read : -EINVAL;
+    }
+
+    entry = entry_alloc(&addr);
+
+    if (!entry) {
+        return -ENOMEM;
+    }
+
+    entry->handles = handles;
+
+    return 0;
+}
+
+static void persist_work_handler(struct k_work* work)
+{
+    char key[sizeof(HANDLE_CACHE_SETTINGS_KEY "/") + HANDLE_CACHE_ADDR_LEN];
+    struct handle_cache_entry entry;
+    k_spinlock_key_t lock_key;
+    int err;
+
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        lock_key = k_spin_lock(&lock);
+        entry = entries[i];
+        entries[i].dirty = false;
+        k_spin_unlock(&lock, lock_key);
+
+        if (!entry.dirty) {
+            continue;
+        }
+
+        key_from_addr(&entry.addr, key, sizeof(key));
+
+        if (entry.used) {
+            err = settings_save_one(key, &entry.handles, sizeof(entry.handles));
+        } else {
+            err = settings_delete(key);
+        }
+
+        if (err) {
+            LOG_ERR("Saving handles failed (err %d)", err);
+        }
+    }
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(sphero_handles, HANDLE_CACHE_SETTINGS_KEY, NULL, handle_cache_set, NULL, NULL);
+
+int handle_cache_init(void)
+{
+    int err;
+
+    err = settings_subsys_init();
+    if (err) {
+        LOG_ERR("Settings init failed (err %d)", err);
+        return err;
+    }
+
+    err = settings_load_subtree(HANDLE_CACHE_SETTINGS_KEY);
+    if (err) {
+        LOG_ERR("Loading cached handles failed (err %d)", err);
+    }
+
+    return err;
+}
+
+int handle_cache_get(const bt_addr_le_t* addr, struct bt_sphero_client_handles* handles)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct handle_cache_entry* entry = entry_find(addr);
+
+    if (entry) {
+        *handles = entry->handles;
+    }
+
+    k_spin_unlock(&lock, key);
+
+    return entry ? 0 : -ENOENT;
+}
+
+int handle_cache_store(const bt_addr_le_t* addr, const struct bt_sphero_client_handles* handles)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct handle_cache_entry* entry = entry_find(addr);
+
+    if (entry && memcmp(&entry->handles, handles, sizeof(*handles)) == 0) {
+        /* Save wearing the flash */
+        k_spin_unlock(&lock, key);
+        return 0;
+    }
+
+    entry = entry_alloc(addr);
+
+    if (!entry) {
+        /* Every entry is waiting to be persisted. Not worth waiting for, the handles are discovered again next time */
+        k_spin_unlock(&lock, key);
+        LOG_WRN("Handle cache busy, not caching handles");
+        return -EBUSY;
+    }
+
+    entry->handles = *handles;
+    entry->dirty = true;
+
+    k_spin_unlock(&lock, key);
+
+    k_work_submit(&persist_work);
+
+    return 0;
+}
+
+int handle_cache_delete(const bt_addr_le_t* addr)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct handle_cache_entry* entry = entry_find(addr);
+
+    if (entry) {
+        entry->used = false;
+        entry->dirty = true;
+    }
+
+    k_spin_unlock(&lock, key);
+
+    if (!entry) {
+        return -ENOENT;
+    }
+
+    k_work_submit(&persist_work);
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef HANDLE_CACHE_H
+#define HANDLE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sphero_client.h"
+#include <zephyr/bluetooth/addr.h>
+
+/**
+ * @brief Number of Spheros whose handles are kept
+ */
+#define HANDLE_CACHE_SIZE (2 * CONFIG_BT_MAX_CONN)
+
+/**
+ * @brief Settings subtree the handles are stored under, one key per address
+ */
+#define HANDLE_CACHE_SETTINGS_KEY "sphero/handles"
+
+/** @brief Initalize the settings subsystem and load the cached handles
+ *
+ * @retval 0 If successful
+ *         Otherwise, a negative error code is returned
+ */
+int handle_cache_init(void);
+
+/** @brief Get the cached handles of a Sphero
+ *
+ * @param[in] addr Address of the Sphero
+ * @param[out] handles The cached handles
+ *
+ * @retval 0 If successful
+ * @retval -ENOENT If nothing is cached for the address
+ */
+int handle_cache_get(const bt_addr_le_t* addr, struct bt_sphero_client_handles* handles);
+
+/** @brief Cache the handles of a Sphero, persisting them if they changed
+ *
+ * Persisting happens on the system work queue, so this is safe to call from the BT RX thread
+ *
+ * @param[in] addr Address of the Sphero
+ * @param[in] handles The discovered handles
+ *
+ * @retval 0 If successful
+ * @retval -EBUSY If every entry is still waiting to be persisted
+ *         Otherwise, a negative error code is returned
+ */
+int handle_cache_store(const bt_addr_le_t* addr, const struct bt_sphero_client_handles* handles);
+
+/** @brief Forget the handles of a Sphero
+ *
+ * They're deleted from flash on the system work queue, like handle_cache_store
+ *
+ * @param[in] addr Address of the Sphero
+ *
+ * @retval 0 If successful
+ *         Otherwise, a negative error code is returned
+ */
+int handle_cache_delete(const bt_addr_le_t* addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HANDLE_CACHE_H
@@ -6,9 +6,11 @@
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
 // Logging
 #include <zephyr/logging/log.h>
 // Clients
+#include "handle_cache.h"
 #include "sphero_client.h"
 
 LOG_MODULE_REGISTER(scanner, LOG_LEVEL_DBG);
@@ -25,29 +27,381 @@ static struct bt_conn* default_conn;
 
 uint64_t last_sphero_found;
 
+/**
+ * @brief A sphero asked for in scanner_init. Its index is the stable id used by scanner_get_slot
+ */
+struct sphero_slot {
+    char name[NAME_LEN];
+
+    /** Current connection (referenced), NULL while disconnected */
+    struct bt_conn* conn;
+
+    /** Client of the current connection, set once discovery has finished and cleared on disconnect */
+    atomic_ptr_t client;
+
+    /** Number of scanner_slot_acquire calls holding a client. A retired client isn't freed until this drops to 0 */
+    atomic_t users;
+
+    /** Client of a lost connection, and its (referenced) connection, waiting for users to drop to 0. The context
+     *  isn't held meanwhile, the retire work takes it again to free it */
+    atomic_ptr_t retired;
+    struct bt_conn* retired_conn;
+
+    /** Frees the retired client on the system work queue, since freeing it waits for the TX work queue */
+    struct k_work retire_work;
+
+    /** TX stalls across every connection, and how many of them dropped the connection */
+    atomic_t stalls;
+    atomic_t stall_disconnects;
+
+    /** Bound with scanner_bind_sphero, restored on every connection */
+    bt_sphero_received_cb_t* received_cb;
+    scanner_connected_cb_t connected_cb;
+    void* context;
+};
+
+static struct sphero_slot slots[CONFIG_BT_MAX_CONN];
+static int slots_count;
+
+/**
+ * Bit per slot, set once it has connected and finished GATT discovery
+ */
+static ATOMIC_DEFINE(spheros_found, CONFIG_BT_MAX_CONN);
+
+/**
+ * Given once every name has been found
+ */
+static K_SEM_DEFINE(all_spheros_found, 0, 1);
+
+/**
+ * Parameters every link is asked to use, set from the number of spheros in scanner_init
+ */
+static struct bt_sphero_link_param link_policy;
+static struct bt_le_conn_param link_conn_param;
+
+static void reconnect_schedule(void);
+static void reconnect_done(void);
+
+static int slot_index_by_conn(struct bt_conn* conn)
+{
+    for (int i = 0; i < slots_count; i++) {
+        if (slots[i].conn == conn) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool all_names_found(void)
+{
+    for (int i = 0; i < slots_count; i++) {
+        if (!atomic_test_bit(spheros_found, i)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Spread the links over the radio schedule, one connection event each per interval */
+static void link_policy_init(int sphero_count)
+{
+    uint32_t interval = DIV_ROUND_UP(sphero_count * SCANNER_LINK_EVENT_US, 1250);
+
+    link_policy.interval = MAX(interval, SCANNER_LINK_INTERVAL_MIN);
+    link_policy.latency = SCANNER_LINK_LATENCY;
+    link_policy.timeout = SCANNER_LINK_TIMEOUT;
+    link_policy.phy = BT_GAP_LE_PHY_2M;
+
+    // Connect with the policy straight away rather than updating afterwards
+    link_conn_param.interval_min = link_policy.interval;
+    link_conn_param.interval_max = link_policy.interval;
+    link_conn_param.latency = link_policy.latency;
+    link_conn_param.timeout = link_policy.timeout;
+
+    LOG_INF("Link policy: %u us interval for %d spheros", link_policy.interval * 1250, sphero_count);
+}
+
+/* Request the link policy and a larger MTU once the handles of the sphero are known */
+static void link_configure(struct bt_sphero_client* sphero)
+{
+    int err = bt_sphero_client_request_link(sphero, &link_policy);
+
+    if (err) {
+        LOG_WRN("Link parameters couldn't be requested (err %d)", err);
+    }
+
+    bt_sphero_client_exchange_mtu(sphero);
+}
+
+/* Restore what was bound to the slot on the new connection */
+static void slot_bind(int index, struct bt_sphero_client* sphero)
+{
+    struct sphero_slot* slot = &slots[index];
+    int err;
+
+    if (!slot->received_cb) {
+        return;
+    }
+
+    err = bt_sphero_subscribe(sphero, slot->received_cb, slot->context);
+
+    if (err && err != -EALREADY) {
+        LOG_ERR("Failed to subscribe %s (err %d)", slot->name, err);
+    }
+}
+
+static void sphero_found(struct bt_sphero_client* sphero)
+{
+    int index = slot_index_by_conn(sphero->conn);
+
+    if (index < 0) {
+        LOG_WRN("Discovered a Sphero that wasn't asked for");
+        return;
+    }
+
+    slot_bind(index, sphero);
+
+    atomic_ptr_set(&slots[index].client, sphero);
+
+    if (atomic_test_and_set_bit(spheros_found, index)) {
+        /* Rediscovered on the same connection */
+        return;
+    }
+
+    LOG_INF("Found %s", slots[index].name);
+
+    if (slots[index].connected_cb) {
+        slots[index].connected_cb(index, slots[index].context);
+    }
+
+    if (all_names_found()) {
+        k_sem_give(&all_spheros_found);
+        reconnect_done();
+    }
+}
+
+/* Return the client and context of a lost connection. Nobody may be holding the client
+ *
+ * The context is taken and released here since its lock must be released by the thread that took it */
+static void client_free(struct bt_conn* conn)
+{
+    struct bt_sphero_client* sphero = bt_conn_ctx_get(&conns_ctx_lib, conn);
+    int err;
+
+    if (sphero) {
+        /* Return packets queued by the last users to the TX pool */
+        bt_sphero_client_tx_flush(sphero);
+        bt_conn_ctx_release(&conns_ctx_lib, (void*)sphero);
+    }
+
+    err = bt_conn_ctx_free(&conns_ctx_lib, conn);
+
+    if (err) {
+        LOG_WRN("The connection context could not be freed (err %d)", err);
+    }
+}
+
+static void slot_retire_work_handler(struct k_work* work)
+{
+    struct sphero_slot* slot = CONTAINER_OF(work, struct sphero_slot, retire_work);
+    struct bt_sphero_client* sphero = atomic_ptr_clear(&slot->retired);
+    struct bt_conn* conn = slot->retired_conn;
+
+    if (!sphero) {
+        return;
+    }
+
+    slot->retired_conn = NULL;
+
+    client_free(conn);
+    bt_conn_unref(conn);
+}
+
+/* Detach the slot from its connection. sphero may be NULL if the connection never got a client
+ *
+ * Returns true if the slot took over the client, which is then freed once its last user releases it */
+static bool sphero_lost(struct bt_conn* conn, struct bt_sphero_client* sphero)
+{
+    int index = slot_index_by_conn(conn);
+    bool retired = false;
+
+    if (index < 0) {
+        return false;
+    }
+
+    if (sphero && atomic_ptr_clear(&slots[index].client)) {
+        /* Users still holding the client can't queue any more and stop waiting on it */
+        bt_sphero_client_tx_close(sphero);
+
+        if (atomic_ptr_get(&slots[index].retired)) {
+            /* Users hold the client for one command, far shorter than it takes to reconnect */
+            LOG_ERR("%s lost again before its last client was released", slots[index].name);
+        }
+
+        slots[index].retired_conn = bt_conn_ref(conn);
+        atomic_ptr_set(&slots[index].retired, sphero);
+
+        /* Otherwise the last scanner_slot_release frees it */
+        if (atomic_get(&slots[index].users) == 0) {
+            k_work_submit(&slots[index].retire_work);
+        }
+
+        retired = true;
+    }
+
+    bt_conn_unref(slots[index].conn);
+    slots[index].conn = NULL;
+
+    if (atomic_test_and_clear_bit(spheros_found, index)) {
+        LOG_WRN("Lost %s", slots[index].name);
+    }
+
+    k_sem_reset(&all_spheros_found);
+
+    reconnect_schedule();
+
+    return retired;
+}
+
+/**
+ * Start scanning again unless every sphero is connected or there's no room for another connection
+ */
+static void scan_resume(void)
+{
+    int err;
+
+    if (all_names_found() || bt_conn_ctx_count(&conns_ctx_lib) >= CONFIG_BT_MAX_CONN) {
+        return;
+    }
+
+    err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
+
+    if (err && err != -EALREADY) {
+        LOG_ERR("Scanning failed to start (err %d)", err);
+    } else {
+        LOG_INF("Scanning started");
+    }
+}
+
+/**
+ * Reconnect service
+ *
+ * Once the initial scan is stopped, scan for SCANNER_RECONNECT_SCAN_MS at a time with an exponential backoff in between
+ * while any sphero is missing. The scan module connects to whichever missing sphero it sees, and the backoff resets
+ * once all are connected again
+ */
+
+static void reconnect_scan_start(struct k_work* work);
+static void reconnect_scan_stop(struct k_work* work);
+
+static K_WORK_DELAYABLE_DEFINE(reconnect_start_work, reconnect_scan_start);
+static K_WORK_DELAYABLE_DEFINE(reconnect_stop_work, reconnect_scan_stop);
+static uint32_t reconnect_backoff_ms = SCANNER_RECONNECT_BACKOFF_MIN_MS;
+static bool reconnect_enabled;
+
+static void reconnect_scan_start(struct k_work* work)
+{
+    if (all_names_found()) {
+        return;
+    }
+
+    LOG_INF("Scanning for missing spheros");
+
+    scan_resume();
+
+    k_work_reschedule(&reconnect_stop_work, K_MSEC(SCANNER_RECONNECT_SCAN_MS));
+}
+
+static void reconnect_scan_stop(struct k_work* work)
+{
+    int err;
+
+    if (all_names_found()) {
+        return;
+    }
+
+    err = bt_scan_stop();
+    if (err && err != -EALREADY) {
+        LOG_ERR("Stop LE scan failed (err %d)", err);
+    }
+
+    reconnect_backoff_ms = MIN(2 * reconnect_backoff_ms, SCANNER_RECONNECT_BACKOFF_MAX_MS);
+
+    LOG_DBG("Next reconnect scan in %u ms", reconnect_backoff_ms);
+
+    k_work_reschedule(&reconnect_start_work, K_MSEC(reconnect_backoff_ms));
+}
+
+static void reconnect_schedule(void)
+{
+    if (!reconnect_enabled) {
+        return;
+    }
+
+    /* Doesn't move an earlier attempt */
+    k_work_schedule(&reconnect_start_work, K_MSEC(reconnect_backoff_ms));
+}
+
+static void reconnect_done(void)
+{
+    k_work_cancel_delayable(&reconnect_start_work);
+    k_work_cancel_delayable(&reconnect_stop_work);
+
+    reconnect_backoff_ms = SCANNER_RECONNECT_BACKOFF_MIN_MS;
+}
+
 /**
  * Service discovery
+ *
+ * The GATT Discovery Manager runs one discovery at a time, so connections that come up while one is running wait in
+ * discovery_queue. Everything here runs from the BT RX thread so no locking is needed
  */
 
+static struct bt_conn* discovery_conn;
+static struct bt_conn* discovery_queue[CONFIG_BT_MAX_CONN];
+static int discovery_queue_len;
+
+static void discovery_next(void);
+
 static void discovery_complete(struct bt_gatt_dm* dm, void* context)
 {
     LOG_INF("Discovery complete");
 
     struct bt_sphero_client* sphero = context;
+    struct bt_conn* conn = bt_gatt_dm_conn_get(dm);
+    int err;
 
-    bt_sphero_handles_assign(dm, sphero);
+    err = bt_sphero_handles_assign(dm, sphero);
 
     bt_gatt_dm_data_release(dm);
 
-    int err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
-
     if (err) {
-        LOG_ERR("Scanning failed to start (err %d)", err);
-    } else {
-        LOG_INF("Scanning started");
-        last_sphero_found = k_uptime_get();
+        /* The client has no connection or handles, so it can't be found or bound to a slot. Reconnecting discovers
+         * again */
+        LOG_ERR("Could not assign handles (err %d), disconnecting", err);
+
+        err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        if (err) {
+            LOG_ERR("Failed to disconnect (err %d)", err);
+        }
+
+        discovery_next();
+        return;
     }
 
+    handle_cache_store(bt_conn_get_dst(sphero->conn), &sphero->handles);
+
+    link_configure(sphero);
+
+    // Also subscribes again if this was a rediscovery after the cached handles failed
+    sphero_found(sphero);
+
+    last_sphero_found = k_uptime_get();
+
+    discovery_next();
+
     // // Send wake up message
 
     // unsigned char data[] = { 0x8d, 0xa, 0x13, 0xd, 0x0, 0xd5, 0xd8 };
@@ -62,12 +416,7 @@ static void discovery_service_not_found(struct bt_conn* conn,
 {
     LOG_INF("Service not found");
 
-    int err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
-    if (err) {
-        LOG_ERR("Scanning failed to start (err %d)", err);
-    } else {
-        LOG_INF("Scanning started");
-    }
+    discovery_next();
 }
 
 static void discovery_error(struct bt_conn* conn,
@@ -75,6 +424,8 @@ static void discovery_error(struct bt_conn* conn,
     void* context)
 {
     LOG_WRN("Error while discovering GATT database: (%d)", err);
+
+    discovery_next();
 }
 
 struct bt_gatt_dm_cb discovery_cb = {
@@ -83,23 +434,93 @@ struct bt_gatt_dm_cb discovery_cb = {
     .error_found = discovery_error,
 };
 
-static void gatt_discover(struct bt_conn* conn)
+static int discovery_start(struct bt_conn* conn)
 {
     int err;
 
     struct bt_sphero_client* sphero_client = bt_conn_ctx_get(&conns_ctx_lib, conn);
 
     if (!sphero_client) {
-        return;
+        return -ENOTCONN;
     }
 
     err = bt_gatt_dm_start(conn, BT_SPHERO_SERVICE_UUID, &discovery_cb, sphero_client);
 
     if (err) {
         LOG_ERR("Could not start the discovery procedure, error: %d", err);
+    } else {
+        discovery_conn = bt_conn_ref(conn);
     }
 
     bt_conn_ctx_release(&conns_ctx_lib, (void*)sphero_client);
+
+    return err;
+}
+
+/* Finish the current discovery and start the next queued one */
+static void discovery_next(void)
+{
+    struct bt_conn* conn;
+
+    if (discovery_conn) {
+        bt_conn_unref(discovery_conn);
+        discovery_conn = NULL;
+    }
+
+    while (discovery_queue_len > 0) {
+        conn = discovery_queue[0];
+
+        discovery_queue_len--;
+        memmove(&discovery_queue[0], &discovery_queue[1], discovery_queue_len * sizeof(discovery_queue[0]));
+
+        int err = discovery_start(conn);
+
+        bt_conn_unref(conn);
+
+        if (!err) {
+            return;
+        }
+    }
+}
+
+/* Drop a connection from the discovery queue */
+static void discovery_cancel(struct bt_conn* conn)
+{
+    for (int i = 0; i < discovery_queue_len; i++) {
+        if (discovery_queue[i] == conn) {
+            bt_conn_unref(conn);
+
+            discovery_queue_len--;
+            memmove(&discovery_queue[i], &discovery_queue[i + 1], (discovery_queue_len - i) * sizeof(discovery_queue[0]));
+
+            return;
+        }
+    }
+}
+
+static void gatt_discover(struct bt_conn* conn)
+{
+    if (discovery_conn == NULL) {
+        discovery_start(conn);
+        return;
+    }
+
+    if (discovery_conn == conn) {
+        return;
+    }
+
+    for (int i = 0; i < discovery_queue_len; i++) {
+        if (discovery_queue[i] == conn) {
+            return;
+        }
+    }
+
+    if (discovery_queue_len >= ARRAY_SIZE(discovery_queue)) {
+        LOG_ERR("Discovery queue is full");
+        return;
+    }
+
+    discovery_queue[discovery_queue_len++] = bt_conn_ref(conn);
 }
 
 /**
@@ -111,6 +532,37 @@ static void sphero_sent(struct bt_sphero_client* sphero, uint8_t err, const uint
     LOG_DBG("Sent!");
 }
 
+static void sphero_stalled(struct bt_sphero_client* sphero, bool disconnecting)
+{
+    int index = slot_index_by_conn(sphero->conn);
+
+    if (index < 0) {
+        return;
+    }
+
+    atomic_inc(&slots[index].stalls);
+
+    if (disconnecting) {
+        atomic_inc(&slots[index].stall_disconnects);
+    }
+
+    LOG_WRN("%s stalled (%ld times so far)%s", slots[index].name, atomic_get(&slots[index].stalls),
+        disconnecting ? ", reconnecting" : "");
+}
+
+static void sphero_subscribed(struct bt_sphero_client* sphero, uint8_t err)
+{
+    if (!err || !sphero->handles_cached) {
+        return;
+    }
+
+    LOG_WRN("Subscribing with cached handles failed, falling back to discovery");
+
+    handle_cache_delete(bt_conn_get_dst(sphero->conn));
+
+    gatt_discover(sphero->conn);
+}
+
 /*
  * Connected code
  */
@@ -120,21 +572,26 @@ static void connected(struct bt_conn* conn, uint8_t conn_err)
     char addr[BT_ADDR_LE_STR_LEN];
     int err;
 
-    struct bt_sphero_client_init_param init = {};
+    struct bt_sphero_client_init_param init = {
+        .cb = {
+            .subscribed = sphero_subscribed,
+            .stalled = sphero_stalled,
+        },
+    };
+    struct bt_sphero_client_handles handles;
 
     bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
     if (conn_err) {
         LOG_INF("Failed to connect to %s (%d)", addr, conn_err);
 
+        sphero_lost(conn, NULL);
+
         if (default_conn == conn) {
             bt_conn_unref(default_conn);
             default_conn = NULL;
 
-            err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
-            if (err) {
-                LOG_ERR("Scanning failed to start (err %d)", err);
-            }
+            scan_resume();
         }
 
         return;
@@ -148,48 +605,73 @@ static void connected(struct bt_conn* conn, uint8_t conn_err)
 
     if (!sphero_client) {
         LOG_WRN("There is no free memory to allocate the connection context");
+        return;
     }
 
     memset(sphero_client, 0, bt_conn_ctx_block_size_get(&conns_ctx_lib));
 
     err = bt_sphero_client_init(sphero_client, &init);
 
-    bt_conn_ctx_release(&conns_ctx_lib, (void*)sphero_client);
-
     if (err) {
         LOG_ERR("Sphero client initalization failed (err %d)", err);
     } else {
         LOG_INF("Sphero Client module initalized");
     }
 
-    gatt_discover(conn);
+    if (handle_cache_get(bt_conn_get_dst(conn), &handles) == 0) {
+        // Handles are the same across sessions so skip discovery. Subscribing falls back to discovery if they're wrong
+        LOG_INF("Using cached handles");
 
-    // Stop scanning during discovery
+        bt_sphero_handles_set(sphero_client, conn, &handles);
+        link_configure(sphero_client);
 
-    err = bt_scan_stop();
-    if ((!err) && (err != -EALREADY)) {
-        LOG_ERR("Stop LE scan failed (err %d)", err);
+        sphero_found(sphero_client);
+        last_sphero_found = k_uptime_get();
+    } else {
+        gatt_discover(conn);
+    }
+
+    bt_conn_ctx_release(&conns_ctx_lib, (void*)sphero_client);
+
+    // The scan module stops scanning to create the connection. Look for the next sphero while this one is discovered
+    if (default_conn == conn) {
+        bt_conn_unref(default_conn);
+        default_conn = NULL;
     }
+
+    scan_resume();
 }
 
 static void disconnected(struct bt_conn* conn, uint8_t reason)
 {
     char addr[BT_ADDR_LE_STR_LEN];
-    int err;
+    struct bt_sphero_client* sphero_client;
+    bool retired;
 
     bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
     LOG_INF("Disconnected: %s (reason %u)", addr,
         reason);
 
-    err = bt_conn_ctx_free(&conns_ctx_lib, conn);
+    discovery_cancel(conn);
 
-    if (err) {
-        LOG_WRN("The connection context could not be freed (err %d)", err);
+    sphero_client = bt_conn_ctx_get(&conns_ctx_lib, conn);
+
+    retired = sphero_lost(conn, sphero_client);
+
+    if (sphero_client) {
+        bt_conn_ctx_release(&conns_ctx_lib, (void*)sphero_client);
     }
 
-    bt_conn_unref(conn);
-    default_conn = NULL;
+    if (!retired) {
+        /* Never handed out, so nobody can be holding it */
+        client_free(conn);
+    }
+
+    if (default_conn == conn) {
+        bt_conn_unref(default_conn);
+        default_conn = NULL;
+    }
 }
 
 static void security_changed(struct bt_conn* conn, bt_security_t level,
@@ -209,10 +691,55 @@ static void security_changed(struct bt_conn* conn, bt_security_t level,
     gatt_discover(conn);
 }
 
+static bool le_param_req(struct bt_conn* conn, struct bt_le_conn_param* param)
+{
+    char addr[BT_ADDR_LE_STR_LEN];
+
+    // Only accept requests which allow the shared interval, otherwise the link would collide with the others
+    if (param->interval_min <= link_policy.interval && link_policy.interval <= param->interval_max) {
+        param->interval_min = link_policy.interval;
+        param->interval_max = link_policy.interval;
+        return true;
+    }
+
+    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+    LOG_WRN("Rejected connection interval %u-%u from %s", param->interval_min, param->interval_max, addr);
+
+    return false;
+}
+
+static void le_param_updated(struct bt_conn* conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+    char addr[BT_ADDR_LE_STR_LEN];
+
+    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+    if (interval != link_policy.interval || latency != link_policy.latency) {
+        LOG_WRN("Connection parameters of %s: interval %u us latency %u timeout %u ms, wanted interval %u us",
+            addr, interval * 1250, latency, timeout * 10, link_policy.interval * 1250);
+    } else {
+        LOG_INF("Connection parameters of %s: interval %u us latency %u timeout %u ms", addr, interval * 1250,
+            latency, timeout * 10);
+    }
+}
+
+static void le_phy_updated(struct bt_conn* conn, struct bt_conn_le_phy_info* param)
+{
+    char addr[BT_ADDR_LE_STR_LEN];
+
+    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+    LOG_INF("PHY of %s: TX %u RX %u", addr, param->tx_phy, param->rx_phy);
+}
+
 BT_CONN_CB_DEFINE(conn_callbacks) = {
     .connected = connected,
     .disconnected = disconnected,
     .security_changed = security_changed,
+    .le_param_req = le_param_req,
+    .le_param_updated = le_param_updated,
+    .le_phy_updated = le_phy_updated,
 };
 
 /*
@@ -261,6 +788,13 @@ static void scan_connecting(struct bt_scan_device_info* device_info, struct bt_c
 
     LOG_DBG("Connecting to %s", name);
 
+    for (int i = 0; i < slots_count; i++) {
+        if (slots[i].conn == NULL && strncmp(name, slots[i].name, NAME_LEN) == 0) {
+            slots[i].conn = bt_conn_ref(conn);
+            break;
+        }
+    }
+
     default_conn = bt_conn_ref(conn);
 }
 
@@ -273,6 +807,7 @@ static int scanner_scan_init(char* sphero_names[], int sphero_names_len)
         .connect_if_match = 1,
         .scan_param = BT_LE_SCAN_PARAM(BT_LE_SCAN_TYPE_ACTIVE, BT_LE_SCAN_OPT_NONE,
             BT_GAP_SCAN_FAST_INTERVAL, BT_GAP_SCAN_FAST_WINDOW),
+        .conn_param = &link_conn_param,
     };
 
     bt_scan_init(&scan_init);
@@ -300,12 +835,34 @@ int scanner_init(char* names[], int sphero_names_len)
 {
     int err;
 
+    if (sphero_names_len > CONFIG_BT_MAX_CONN) {
+        LOG_ERR("Can't connect to more than %d spheros", CONFIG_BT_MAX_CONN);
+        return -EINVAL;
+    }
+
+    for (int i = 0; i < sphero_names_len; i++) {
+        strncpy(slots[i].name, names[i], NAME_LEN - 1);
+        slots[i].name[NAME_LEN - 1] = '\0';
+        k_work_init(&slots[i].retire_work, slot_retire_work_handler);
+    }
+
+    slots_count = sphero_names_len;
+
+    link_policy_init(sphero_names_len);
+
     err = bt_enable(NULL);
     if (err) {
         LOG_ERR("Bluetooth init failed (err %d)", err);
         return err;
     }
 
+    err = handle_cache_init();
+
+    if (err) {
+        // Not fatal, every connection will run discovery
+        LOG_WRN("Handle cache failed to initialize (err %d)", err);
+    }
+
     err = scanner_scan_init(names, sphero_names_len);
 
     if (err != 0) {
@@ -336,24 +893,123 @@ int scanner_stop()
         return err;
     }
 
+    // From now on the reconnect service looks for missing spheros
+    reconnect_enabled = true;
+
+    if (!all_names_found()) {
+        reconnect_schedule();
+    }
+
+    return 0;
+}
+
+int scanner_wait_for_all(k_timeout_t timeout)
+{
+    if (k_sem_take(&all_spheros_found, timeout) != 0) {
+        return -EAGAIN;
+    }
+
+    /* Leave it given so later calls return straight away */
+    k_sem_give(&all_spheros_found);
+
     return 0;
 }
 
+int scanner_get_missing(const char* missing[], int missing_len)
+{
+    int count = 0;
+
+    for (int i = 0; i < slots_count; i++) {
+        if (atomic_test_bit(spheros_found, i)) {
+            continue;
+        }
+
+        if (count < missing_len) {
+            missing[count] = slots[i].name;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
 unsigned int scanner_get_sphero_count()
 {
     return bt_conn_ctx_count(&conns_ctx_lib);
 }
 
-struct bt_sphero_client* scanner_get_sphero(uint8_t id)
+unsigned int scanner_get_name_count()
+{
+    return slots_count;
+}
+
+struct sphero_slot* scanner_get_slot(uint8_t id)
+{
+    if (id >= slots_count) {
+        return NULL;
+    }
+
+    return &slots[id];
+}
+
+struct bt_sphero_client* scanner_slot_acquire(struct sphero_slot* slot)
 {
-    const struct bt_conn_ctx* ctx = bt_conn_ctx_get_by_id(&conns_ctx_lib, id);
+    struct bt_sphero_client* client;
 
-    struct bt_sphero_client* sphero = ctx->data;
+    if (!slot) {
+        return NULL;
+    }
+
+    atomic_inc(&slot->users);
+
+    client = atomic_ptr_get(&slot->client);
+
+    if (!client) {
+        /* May still be the last user of a retired client */
+        scanner_slot_release(slot);
+    }
+
+    return client;
+}
 
-    return sphero;
+void scanner_slot_release(struct sphero_slot* slot)
+{
+    if (atomic_dec(&slot->users) == 1 && atomic_ptr_get(&slot->retired)) {
+        k_work_submit(&slot->retire_work);
+    }
 }
 
-void scanner_release_sphero(struct bt_sphero_client* sphero)
+uint32_t scanner_slot_get_stalls(struct sphero_slot* slot, uint32_t* disconnects)
 {
-    bt_conn_ctx_release(&conns_ctx_lib, sphero);
+    if (!slot) {
+        return 0;
+    }
+
+    if (disconnects) {
+        *disconnects = atomic_get(&slot->stall_disconnects);
+    }
+
+    return atomic_get(&slot->stalls);
+}
+
+void scanner_bind_sphero(uint8_t id, bt_sphero_received_cb_t* received_cb, scanner_connected_cb_t connected_cb, void* context)
+{
+    struct bt_sphero_client* sphero;
+
+    if (id >= slots_count) {
+        return;
+    }
+
+    slots[id].received_cb = received_cb;
+    slots[id].connected_cb = connected_cb;
+    slots[id].context = context;
+
+    sphero = scanner_slot_acquire(&slots[id]);
+
+    if (sphero) {
+        // Already connected
+        slot_bind(id, sphero);
+        scanner_slot_release(&slots[id]);
+    }
 }
\ No newline at end of file
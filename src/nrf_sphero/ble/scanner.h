@@ -1,4 +1,6 @@
+#include "sphero_client.h"
 #include <stdint.h>
+#include <zephyr/kernel.h>
 
 #ifndef SPHERO_SCANNER_H
 #define SPHERO_SCANNER_H
@@ -9,6 +11,53 @@ extern "C" {
 
 extern uint64_t last_sphero_found;
 
+/**
+ * @brief Shortest wait before scanning for a sphero that dropped
+ */
+#define SCANNER_RECONNECT_BACKOFF_MIN_MS 500
+
+/**
+ * @brief Longest wait between scans for missing spheros
+ */
+#define SCANNER_RECONNECT_BACKOFF_MAX_MS 30000
+
+/**
+ * @brief How long each reconnect scan lasts
+ */
+#define SCANNER_RECONNECT_SCAN_MS 3000
+
+/**
+ * @brief Air time budgeted for each link's connection event, in microseconds
+ *
+ * Every link is given the same connection interval, with room for one event per sphero, so the controller can place
+ * their anchor points one after another instead of on top of each other. Keep in sync with
+ * CONFIG_BT_CTLR_SDC_MAX_CONN_EVENT_LEN_DEFAULT
+ */
+#define SCANNER_LINK_EVENT_US 1250
+
+/**
+ * @brief Shortest connection interval requested, in 1.25 ms units (7.5 ms, the minimum allowed)
+ */
+#define SCANNER_LINK_INTERVAL_MIN 6
+
+/**
+ * @brief Peripheral latency requested. Any latency would delay commands to the sphero
+ */
+#define SCANNER_LINK_LATENCY 0
+
+/**
+ * @brief Supervision timeout requested, in 10 ms units
+ */
+#define SCANNER_LINK_TIMEOUT 200
+
+/**
+ * @brief Called from the BT RX thread every time the sphero connects and is ready to use, including reconnects
+ *
+ * @param[in] id The id of the sphero
+ * @param[in] context Context given to scanner_bind_sphero
+ */
+typedef void (*scanner_connected_cb_t)(uint8_t id, void* context);
+
 /**
  * @brief Initalize bluetooth to scan for spheros
  */
@@ -27,31 +76,102 @@ int scanner_start();
 /**
  * @brief Stop scanning for spheros
  *
+ * Spheros which are missing or drop later are then looked for by the reconnect service, with a backoff between scans
+ *
  * @returns 0 on success
  *          Otherwise, error code
  */
 int scanner_stop();
 
+/**
+ * @brief Wait until every name passed to scanner_init has connected and finished GATT discovery
+ *
+ * @param[in] timeout How long to wait
+ *
+ * @returns 0 once all spheros have been found
+ *          -EAGAIN if the timeout expired first
+ */
+int scanner_wait_for_all(k_timeout_t timeout);
+
+/**
+ * @brief Get the names passed to scanner_init which haven't been found yet
+ *
+ * @param[out] missing Filled with pointers to the missing names
+ * @param[in] missing_len Size of missing
+ *
+ * @returns The number of missing names, which may be more than missing_len
+ */
+int scanner_get_missing(const char* missing[], int missing_len);
+
 /**
  * @brief Get the number of spheros found
  */
 unsigned int scanner_get_sphero_count();
 
 /**
- * @brief Get sphero with specified id
+ * @brief Get the number of names passed to scanner_init, which is also the number of sphero ids
+ */
+unsigned int scanner_get_name_count();
+
+/**
+ * @brief Registry slot of a sphero, permanent for the name it was given in scanner_init
+ */
+struct sphero_slot;
+
+/**
+ * @brief Get the registry slot of the sphero with specified id
+ *
+ * Ids are the index of the sphero's name in scanner_init and stay the same across reconnects. The slot can be kept
+ * for as long as the scanner is running, so look it up once and use scanner_slot_acquire to send
+ *
+ * @param[in] id The id of the sphero
+ *
+ * @return The slot, NULL if the id is out of range
+ */
+struct sphero_slot* scanner_get_slot(uint8_t id);
+
+/**
+ * @brief Get the client of the sphero's current connection without any lookup
  *
- * @param[in] id The id of the sphero to get
+ * The client stays valid until scanner_slot_release, even if the sphero disconnects in the meantime. A lost client
+ * is only freed once its last user has released it, so release it promptly
  *
- * @return sphero_client The sphero client
+ * @param[in] slot The slot of the sphero
+ *
+ * @return sphero_client The sphero client, NULL if it's not connected. Must be released with scanner_slot_release
+ *         unless NULL
  */
-struct bt_sphero_client* scanner_get_sphero(uint8_t id);
+struct bt_sphero_client* scanner_slot_acquire(struct sphero_slot* slot);
 
 /**
- * @brief Release sphero
+ * @brief Release a client acquired with scanner_slot_acquire
+ *
+ * @param[in] slot The slot of the sphero
+ */
+void scanner_slot_release(struct sphero_slot* slot);
+
+/**
+ * @brief Get how often the TX pipeline of the sphero has stalled, over all of its connections
+ *
+ * @param[in] slot The slot of the sphero
+ * @param[out] disconnects Set to the number of stalls which dropped the connection. May be NULL
+ *
+ * @return The number of stalls
+ */
+uint32_t scanner_slot_get_stalls(struct sphero_slot* slot, uint32_t* disconnects);
+
+/**
+ * @brief Bind callbacks to a sphero id, restored on every (re)connection
+ *
+ * Notifications are subscribed to with received_cb as soon as the sphero is connected, and connected_cb is called
+ * after every reconnect
  *
- * @param[in] sphero_client The sphero client to release
+ * @param[in] id The id of the sphero
+ * @param[in] received_cb Called with the data of every notification
+ * @param[in] connected_cb Called every time the sphero connects. May be NULL
+ * @param[in] context Passed to both callbacks
  */
-void scanner_release_sphero(struct bt_sphero_client* sphero_client);
+void scanner_bind_sphero(uint8_t id, bt_sphero_received_cb_t* received_cb, scanner_connected_cb_t connected_cb, void* context);
 
 #ifdef __cplusplus
 }
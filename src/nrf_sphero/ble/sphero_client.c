@@ -1,6 +1,10 @@
+#include <zephyr/bluetooth/att.h>
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
 #include <zephyr/bluetooth/uuid.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
 
 #include "sphero_client.h"
 
@@ -11,6 +15,7 @@ enum {
     SPHERO_C_INITALIZED,
     SPHERO_C_NOTIF_ENABLED,
     SPHERO_C_WRITE_PENDING,
+    SPHERO_C_TX_CLOSED,
 };
 
 static uint8_t on_received(struct bt_conn* conn, struct bt_gatt_subscribe_params* params, const void* data, uint16_t length)
@@ -21,6 +26,11 @@ static uint8_t on_received(struct bt_conn* conn, struct bt_gatt_subscribe_params
     // Retrieve Sphero Client module context
     sphero_c = CONTAINER_OF(params, struct bt_sphero_client, sphero_packet_subscribe_params);
 
+    if (data) {
+        atomic_inc(&sphero_c->counters.notifications);
+        atomic_add(&sphero_c->counters.bytes_received, length);
+    }
+
     if (sphero_c->cb.received) {
         return sphero_c->cb.received(sphero_c, data, length, sphero_c->cb.recieved_context);
     }
@@ -28,29 +38,429 @@ static uint8_t on_received(struct bt_conn* conn, struct bt_gatt_subscribe_params
     return BT_GATT_ITER_CONTINUE;
 }
 
+/* Stack size of the work queue which drains the TX queues */
+#define BT_SPHERO_TX_STACK_SIZE 2048
+
+/* Delay before retrying a write which failed because the stack had no free buffers */
+#define BT_SPHERO_TX_RETRY_DELAY K_MSEC(5)
+
+K_THREAD_STACK_DEFINE(tx_wq_stack, BT_SPHERO_TX_STACK_SIZE);
+static struct k_work_q tx_wq;
+static bool tx_started;
+
+/* Pool of TX buffers shared by all connections. Free buffers are kept in tx_free */
+static struct bt_sphero_tx_buf tx_bufs[BT_SPHERO_TX_BUF_COUNT];
+static K_FIFO_DEFINE(tx_free);
+static atomic_t tx_free_count;
+
+static void tx_start(void)
+{
+    const struct k_work_queue_config cfg = {
+        .name = "sphero_tx",
+    };
+
+    if (tx_started) {
+        return;
+    }
+
+    tx_started = true;
+
+    for (size_t i = 0; i < ARRAY_SIZE(tx_bufs); i++) {
+        bt_sphero_client_tx_free(&tx_bufs[i]);
+    }
+
+    k_work_queue_init(&tx_wq);
+    k_work_queue_start(&tx_wq, tx_wq_stack, K_THREAD_STACK_SIZEOF(tx_wq_stack), BT_SPHERO_TX_QUEUE_PRIORITY, &cfg);
+}
+
+static void tx_schedule(struct bt_sphero_client* sphero_c)
+{
+    k_work_reschedule_for_queue(&tx_wq, &sphero_c->tx_work, K_NO_WAIT);
+}
+
+/* Whether a write is waiting for its completion, which reschedules the TX work */
+static bool tx_in_flight(struct bt_sphero_client* sphero_c)
+{
+    return atomic_test_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING)
+        || atomic_get(&sphero_c->no_rsp_head) != atomic_get(&sphero_c->no_rsp_tail);
+}
+
+/* Called after a packet is queued. Checked after queueing so a completion in between can't be missed */
+static void tx_kick(struct bt_sphero_client* sphero_c)
+{
+    if (tx_in_flight(sphero_c)) {
+        /* The completion picks the packet up, packed with any others queued in the meantime */
+        return;
+    }
+
+    /* Doesn't move a retry which is already scheduled */
+    k_work_schedule_for_queue(&tx_wq, &sphero_c->tx_work, K_NO_WAIT);
+}
+
+static void watchdog_arm(struct bt_sphero_client* sphero_c);
+
+/* Count the packets in buf as done, wake anyone polling for them and free the buffer */
+static void tx_retire(struct bt_sphero_client* sphero_c, struct bt_sphero_tx_buf* buf)
+{
+    atomic_add(&sphero_c->tx_completed, buf->packets);
+    k_poll_signal_raise(&sphero_c->tx_signal, 0);
+
+    bt_sphero_client_tx_free(buf);
+}
+
+/* Called once every write of a packet has completed. Frees the packet */
+static void tx_complete(struct bt_sphero_client* sphero_c, struct bt_sphero_tx_buf* buf, uint8_t err)
+{
+    /* Run the callback */
+    if (sphero_c->cb.sent) {
+        sphero_c->cb.sent(sphero_c, err, buf->data, buf->len);
+    }
+
+    tx_retire(sphero_c, buf);
+}
+
 static void on_sent(struct bt_conn* conn, uint8_t err, struct bt_gatt_write_params* params)
 {
     struct bt_sphero_client* sphero_c;
-    const void* data;
-    uint16_t length;
+    struct bt_sphero_tx_buf* buf;
 
     /* Retrieve Sphero Client module context */
     sphero_c = CONTAINER_OF(params, struct bt_sphero_client, sphero_packet_write_params);
 
-    /* Make a copy of the volatile data that is required by the callback */
-    data = params->data;
-    length = params->length;
+    /* The TX work queue doesn't touch the current packet while a write is pending */
+    buf = sphero_c->tx_cur;
+
+    if (buf) {
+        sphero_c->tx_offset += params->length;
+
+        if (err) {
+            LOG_ERR("Write failed (err %u), dropping packet", err);
+            atomic_inc(&sphero_c->counters.write_errors);
+        }
+
+        if (err || sphero_c->tx_offset >= buf->len) {
+            sphero_c->tx_cur = NULL;
+            tx_complete(sphero_c, buf, err);
+        }
+    }
 
     /* Clear the write pending flag */
     atomic_clear_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING);
 
-    /* Give the semaphore */
-    k_sem_give(&sphero_c->sending);
+    tx_schedule(sphero_c);
+}
+
+static void on_sent_without_response(struct bt_conn* conn, void* user_data)
+{
+    struct bt_sphero_client* sphero_c = user_data;
+    struct bt_sphero_tx_buf* buf;
+    k_spinlock_key_t key = k_spin_lock(&sphero_c->no_rsp_lock);
+    atomic_val_t head = atomic_get(&sphero_c->no_rsp_head);
+
+    if (head == atomic_get(&sphero_c->no_rsp_tail)) {
+        /* Queue was flushed */
+        k_spin_unlock(&sphero_c->no_rsp_lock, key);
+        return;
+    }
 
-    /* Run the callback */
-    if (sphero_c->cb.sent) {
-        sphero_c->cb.sent(sphero_c, err, data, length);
+    buf = sphero_c->no_rsp_bufs[head % BT_SPHERO_MAX_NO_RSP_PENDING];
+    sphero_c->no_rsp_bufs[head % BT_SPHERO_MAX_NO_RSP_PENDING] = NULL;
+
+    atomic_inc(&sphero_c->no_rsp_head);
+
+    k_spin_unlock(&sphero_c->no_rsp_lock, key);
+
+    /* Only the last write of a packet holds the packet */
+    if (buf) {
+        tx_complete(sphero_c, buf, 0);
+    }
+
+    tx_schedule(sphero_c);
+}
+
+/* Write the next part of the current packet. Returns -EBUSY if the link can't take another write yet */
+static int tx_write(struct bt_sphero_client* sphero_c, struct bt_sphero_tx_buf* buf)
+{
+    uint16_t len = MIN(sphero_c->max_payload, buf->len - sphero_c->tx_offset);
+    const uint8_t* data = buf->data + sphero_c->tx_offset;
+    k_spinlock_key_t key;
+    atomic_val_t tail;
+    bool last;
+    int err;
+
+    if (buf->mode == BT_SPHERO_WRITE_WITH_RSP) {
+        if (atomic_test_and_set_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING)) {
+            return -EBUSY;
+        }
+
+        sphero_c->sphero_packet_write_params.func = on_sent;
+        sphero_c->sphero_packet_write_params.handle = sphero_c->handles.packets;
+        sphero_c->sphero_packet_write_params.offset = 0;
+        sphero_c->sphero_packet_write_params.data = data;
+        sphero_c->sphero_packet_write_params.length = len;
+
+        err = bt_gatt_write(sphero_c->conn, &sphero_c->sphero_packet_write_params);
+        if (err) {
+            atomic_clear_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING);
+        } else {
+            atomic_inc(&sphero_c->counters.writes_sent);
+            atomic_add(&sphero_c->counters.bytes_sent, len);
+        }
+
+        /* on_sent moves on to the next part */
+        return err;
+    }
+
+    key = k_spin_lock(&sphero_c->no_rsp_lock);
+
+    tail = atomic_get(&sphero_c->no_rsp_tail);
+
+    if (tail - atomic_get(&sphero_c->no_rsp_head) >= BT_SPHERO_MAX_NO_RSP_PENDING) {
+        k_spin_unlock(&sphero_c->no_rsp_lock, key);
+        return -EBUSY;
+    }
+
+    last = sphero_c->tx_offset + len >= buf->len;
+
+    /* Publish before writing since the completion can run before the write returns */
+    sphero_c->no_rsp_bufs[tail % BT_SPHERO_MAX_NO_RSP_PENDING] = last ? buf : NULL;
+    atomic_inc(&sphero_c->no_rsp_tail);
+
+    k_spin_unlock(&sphero_c->no_rsp_lock, key);
+
+    err = bt_gatt_write_without_response_cb(sphero_c->conn, sphero_c->handles.packets, data, len, false, on_sent_without_response, sphero_c);
+    if (err) {
+        /* A failed write has no completion, and the earlier ones only ever take entries before it */
+        key = k_spin_lock(&sphero_c->no_rsp_lock);
+        sphero_c->no_rsp_bufs[tail % BT_SPHERO_MAX_NO_RSP_PENDING] = NULL;
+        atomic_dec(&sphero_c->no_rsp_tail);
+        k_spin_unlock(&sphero_c->no_rsp_lock, key);
+        return err;
+    }
+
+    sphero_c->tx_offset += len;
+
+    atomic_inc(&sphero_c->counters.writes_sent);
+    atomic_add(&sphero_c->counters.bytes_sent, len);
+
+    if (last) {
+        /* Owned by the completion now */
+        sphero_c->tx_cur = NULL;
+    }
+
+    return 0;
+}
+
+/* Append queued packets to buf while they fit in a single write */
+static void tx_batch(struct bt_sphero_client* sphero_c, struct bt_sphero_tx_buf* buf)
+{
+    struct bt_sphero_tx_buf* next;
+
+    /* The work queue is the only consumer so the head can't change between the peek and the get */
+    while ((next = k_fifo_peek_head(&sphero_c->tx_queue)) != NULL) {
+        if (buf->len + next->len > sphero_c->max_payload) {
+            break;
+        }
+
+        k_fifo_get(&sphero_c->tx_queue, K_NO_WAIT);
+        atomic_dec(&sphero_c->tx_depth);
+
+        memcpy(buf->data + buf->len, next->data, next->len);
+        buf->len += next->len;
+        buf->packets += next->packets;
+
+        /* Write the batch as a request if any packet in it wanted one */
+        if (next->mode == BT_SPHERO_WRITE_WITH_RSP) {
+            buf->mode = BT_SPHERO_WRITE_WITH_RSP;
+        }
+
+        bt_sphero_client_tx_free(next);
+    }
+}
+
+static void tx_work_handler(struct k_work* work)
+{
+    struct k_work_delayable* dwork = k_work_delayable_from_work(work);
+    struct bt_sphero_client* sphero_c = CONTAINER_OF(dwork, struct bt_sphero_client, tx_work);
+    struct bt_sphero_tx_buf* buf;
+    int err;
+
+    while (!atomic_test_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING)) {
+        if (!sphero_c->tx_cur) {
+            sphero_c->tx_cur = atomic_ptr_clear(&sphero_c->tx_latest);
+
+            if (!sphero_c->tx_cur) {
+                sphero_c->tx_cur = k_fifo_get(&sphero_c->tx_queue, K_NO_WAIT);
+
+                if (!sphero_c->tx_cur) {
+                    return;
+                }
+
+                atomic_dec(&sphero_c->tx_depth);
+            }
+
+            if (sphero_c->tx_cur->len < sphero_c->max_payload) {
+                tx_batch(sphero_c, sphero_c->tx_cur);
+            }
+
+            sphero_c->tx_offset = 0;
+        }
+
+        watchdog_arm(sphero_c);
+
+        err = tx_write(sphero_c, sphero_c->tx_cur);
+
+        if (err == -EBUSY) {
+            /* A completion will reschedule us */
+            return;
+        }
+
+        if (err == -ENOMEM || err == -ENOBUFS) {
+            k_work_reschedule_for_queue(&tx_wq, dwork, BT_SPHERO_TX_RETRY_DELAY);
+            return;
+        }
+
+        if (err) {
+            LOG_ERR("Failed to write packet (err %d), dropping it", err);
+            atomic_inc(&sphero_c->counters.write_errors);
+
+            buf = sphero_c->tx_cur;
+            sphero_c->tx_cur = NULL;
+            tx_complete(sphero_c, buf, BT_ATT_ERR_UNLIKELY);
+        }
+    }
+}
+
+/* Free the current packet and every packet still waiting to be written */
+static void tx_drop_queued(struct bt_sphero_client* sphero_c)
+{
+    struct bt_sphero_tx_buf* buf;
+
+    /* The stack copies the data of a write when it is issued so the current packet can be freed even if pending */
+    if (sphero_c->tx_cur) {
+        tx_retire(sphero_c, sphero_c->tx_cur);
+        sphero_c->tx_cur = NULL;
+    }
+
+    while ((buf = k_fifo_get(&sphero_c->tx_queue, K_NO_WAIT)) != NULL) {
+        atomic_dec(&sphero_c->tx_depth);
+        tx_retire(sphero_c, buf);
+    }
+
+    buf = atomic_ptr_clear(&sphero_c->tx_latest);
+
+    if (buf) {
+        tx_retire(sphero_c, buf);
+    }
+}
+
+/* Forget the writes without response waiting for their completion. Only once the connection is gone, since a
+ * completion arriving afterwards would otherwise be credited to a newer write */
+static void tx_drop_in_flight(struct bt_sphero_client* sphero_c)
+{
+    struct bt_sphero_tx_buf* buf;
+    k_spinlock_key_t key;
+    atomic_val_t head;
+
+    key = k_spin_lock(&sphero_c->no_rsp_lock);
+
+    head = atomic_get(&sphero_c->no_rsp_head);
+
+    for (; head != atomic_get(&sphero_c->no_rsp_tail); head++) {
+        buf = sphero_c->no_rsp_bufs[head % BT_SPHERO_MAX_NO_RSP_PENDING];
+        sphero_c->no_rsp_bufs[head % BT_SPHERO_MAX_NO_RSP_PENDING] = NULL;
+
+        if (buf) {
+            tx_retire(sphero_c, buf);
+        }
+    }
+
+    atomic_set(&sphero_c->no_rsp_head, head);
+
+    k_spin_unlock(&sphero_c->no_rsp_lock, key);
+}
+
+/* Whether anything is waiting to be written or for its write to complete */
+static bool tx_busy(struct bt_sphero_client* sphero_c)
+{
+    return atomic_test_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING) || sphero_c->tx_cur
+        || atomic_get(&sphero_c->no_rsp_head) != atomic_get(&sphero_c->no_rsp_tail)
+        || atomic_get(&sphero_c->tx_depth) > 0 || atomic_ptr_get(&sphero_c->tx_latest);
+}
+
+/* The TX pipeline has made no progress for BT_SPHERO_STALL_TIMEOUT_MS */
+static void tx_stalled(struct bt_sphero_client* sphero_c)
+{
+    bool disconnect;
+    int err;
+
+    sphero_c->watchdog_stalls++;
+
+    /* The stack still owns the write parameters while a Write Request is pending, so it can't be resynced */
+    disconnect = atomic_test_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING)
+        || sphero_c->watchdog_stalls > BT_SPHERO_MAX_RESYNCS;
+
+    if (sphero_c->cb.stalled) {
+        sphero_c->cb.stalled(sphero_c, disconnect);
     }
+
+    if (disconnect) {
+        LOG_ERR("TX stalled %u times, disconnecting", sphero_c->watchdog_stalls);
+
+        err = bt_conn_disconnect(sphero_c->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        if (err) {
+            LOG_ERR("Failed to disconnect (err %d)", err);
+        }
+
+        return;
+    }
+
+    /* Writes already handed to the stack are left to their completions, and if those never come the next stall
+     * disconnects */
+    LOG_WRN("TX stalled, dropping %u queued packets", (unsigned int)atomic_get(&sphero_c->tx_depth));
+
+    tx_drop_queued(sphero_c);
+    tx_schedule(sphero_c);
+}
+
+/* Runs on the TX work queue, so never at the same time as tx_work_handler */
+static void watchdog_handler(struct k_work* work)
+{
+    struct k_work_delayable* dwork = k_work_delayable_from_work(work);
+    struct bt_sphero_client* sphero_c = CONTAINER_OF(dwork, struct bt_sphero_client, watchdog_work);
+    atomic_val_t completed = atomic_get(&sphero_c->tx_completed);
+    int64_t now = k_uptime_get();
+
+    if (!tx_busy(sphero_c)) {
+        /* Idle, armed again by the next write */
+        return;
+    }
+
+    if (completed != sphero_c->watchdog_completed) {
+        /* Making progress */
+        sphero_c->watchdog_completed = completed;
+        sphero_c->watchdog_progress = now;
+        sphero_c->watchdog_stalls = 0;
+    } else if (now - sphero_c->watchdog_progress >= BT_SPHERO_STALL_TIMEOUT_MS) {
+        sphero_c->watchdog_progress = now;
+        tx_stalled(sphero_c);
+    }
+
+    k_work_reschedule_for_queue(&tx_wq, dwork, K_MSEC(BT_SPHERO_WATCHDOG_PERIOD_MS));
+}
+
+/* Start watching the TX pipeline if it was idle. Runs on the TX work queue, so never at the same time as the watchdog */
+static void watchdog_arm(struct bt_sphero_client* sphero_c)
+{
+    if (k_work_delayable_is_pending(&sphero_c->watchdog_work)) {
+        return;
+    }
+
+    sphero_c->watchdog_completed = atomic_get(&sphero_c->tx_completed);
+    sphero_c->watchdog_progress = k_uptime_get();
+    sphero_c->watchdog_stalls = 0;
+
+    k_work_schedule_for_queue(&tx_wq, &sphero_c->watchdog_work, K_MSEC(BT_SPHERO_WATCHDOG_PERIOD_MS));
 }
 
 int bt_sphero_client_init(struct bt_sphero_client* sphero_c, const struct bt_sphero_client_init_param* sphero_c_init)
@@ -65,43 +475,274 @@ int bt_sphero_client_init(struct bt_sphero_client* sphero_c, const struct bt_sph
 
     memcpy(&sphero_c->cb, &sphero_c_init->cb, sizeof(sphero_c->cb));
 
-    k_sem_init(&sphero_c->sending, 1, 1);
+    tx_start();
+
+    k_fifo_init(&sphero_c->tx_queue);
+    k_poll_signal_init(&sphero_c->tx_signal);
+    k_work_init_delayable(&sphero_c->tx_work, tx_work_handler);
+    k_work_init_delayable(&sphero_c->watchdog_work, watchdog_handler);
+
+    sphero_c->max_payload = BT_SPHERO_DEFAULT_PAYLOAD;
+
+    return 0;
+}
+
+struct bt_sphero_tx_buf* bt_sphero_client_tx_alloc(k_timeout_t timeout)
+{
+    struct bt_sphero_tx_buf* buf = k_fifo_get(&tx_free, timeout);
+
+    if (buf) {
+        atomic_dec(&tx_free_count);
+    }
+
+    return buf;
+}
+
+void bt_sphero_client_tx_free(struct bt_sphero_tx_buf* buf)
+{
+    atomic_inc(&tx_free_count);
+    k_fifo_put(&tx_free, buf);
+}
+
+uint32_t bt_sphero_client_tx_bufs_free(void)
+{
+    return atomic_get(&tx_free_count);
+}
+
+int bt_sphero_client_tx_enqueue(struct bt_sphero_client* sphero_c, struct bt_sphero_tx_buf* buf)
+{
+    if (!sphero_c->conn || atomic_test_bit(&sphero_c->state, SPHERO_C_TX_CLOSED)) {
+        bt_sphero_client_tx_free(buf);
+        return -ENOTCONN;
+    }
+
+    buf->packets = 1;
+    atomic_inc(&sphero_c->tx_enqueued);
+
+    atomic_inc(&sphero_c->tx_depth);
+    k_fifo_put(&sphero_c->tx_queue, buf);
+
+    tx_kick(sphero_c);
 
     return 0;
 }
 
-int bt_sphero_client_send(struct bt_sphero_client* sphero_c, const uint8_t* data, uint16_t len)
+int bt_sphero_client_tx_send_latest(struct bt_sphero_client* sphero_c, struct bt_sphero_tx_buf* buf)
+{
+    struct bt_sphero_tx_buf* replaced;
+
+    if (!sphero_c->conn || atomic_test_bit(&sphero_c->state, SPHERO_C_TX_CLOSED)) {
+        bt_sphero_client_tx_free(buf);
+        return -ENOTCONN;
+    }
+
+    buf->packets = 1;
+    atomic_inc(&sphero_c->tx_enqueued);
+
+    replaced = atomic_ptr_set(&sphero_c->tx_latest, buf);
+
+    tx_kick(sphero_c);
+
+    if (replaced) {
+        tx_retire(sphero_c, replaced);
+        return 1;
+    }
+
+    return 0;
+}
+
+uint32_t bt_sphero_client_tx_queue_depth(const struct bt_sphero_client* sphero_c)
+{
+    return atomic_get(&sphero_c->tx_depth);
+}
+
+uint32_t bt_sphero_client_tx_enqueued(const struct bt_sphero_client* sphero_c)
+{
+    return atomic_get(&sphero_c->tx_enqueued);
+}
+
+uint32_t bt_sphero_client_tx_completed(const struct bt_sphero_client* sphero_c)
+{
+    return atomic_get(&sphero_c->tx_completed);
+}
+
+void bt_sphero_client_tx_close(struct bt_sphero_client* sphero_c)
+{
+    atomic_set_bit(&sphero_c->state, SPHERO_C_TX_CLOSED);
+    k_poll_signal_raise(&sphero_c->tx_signal, -ENOTCONN);
+}
+
+bool bt_sphero_client_tx_closed(const struct bt_sphero_client* sphero_c)
+{
+    return atomic_test_bit(&sphero_c->state, SPHERO_C_TX_CLOSED);
+}
+
+void bt_sphero_client_tx_flush(struct bt_sphero_client* sphero_c)
+{
+    struct k_work_sync sync;
+
+    k_work_cancel_delayable_sync(&sphero_c->watchdog_work, &sync);
+    k_work_cancel_delayable_sync(&sphero_c->tx_work, &sync);
+
+    tx_drop_queued(sphero_c);
+    tx_drop_in_flight(sphero_c);
+
+    atomic_clear_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING);
+}
+
+static void on_mtu_exchanged(struct bt_conn* conn, uint8_t err, struct bt_gatt_exchange_params* params)
+{
+    struct bt_sphero_client* sphero_c;
+
+    sphero_c = CONTAINER_OF(params, struct bt_sphero_client, mtu_exchange_params);
+
+    if (err) {
+        LOG_WRN("MTU exchange failed (err %u), using %u byte writes", err, sphero_c->max_payload);
+        return;
+    }
+
+    /* ATT header is 3 bytes */
+    sphero_c->max_payload = MAX(bt_gatt_get_mtu(conn) - 3, BT_SPHERO_DEFAULT_PAYLOAD);
+
+    LOG_INF("MTU exchanged, using %u byte writes", sphero_c->max_payload);
+}
+
+int bt_sphero_client_exchange_mtu(struct bt_sphero_client* sphero_c)
 {
     int err;
 
-    // NOTE: THIS TIMEOUT SHOULD BE SHORTER
-    err = k_sem_take(&sphero_c->sending, K_MSEC(400));
+    if (!sphero_c->conn) {
+        return -ENOTCONN;
+    }
+
+    err = bt_conn_le_data_len_update(sphero_c->conn, BT_LE_DATA_LEN_PARAM_MAX);
+    if (err) {
+        LOG_WRN("Data length update failed (err %d)", err);
+    }
+
+    sphero_c->mtu_exchange_params.func = on_mtu_exchanged;
 
-    if (err != 0) {
-        LOG_ERR("Timeout while sending payload: Err %d", err);
+    err = bt_gatt_exchange_mtu(sphero_c->conn, &sphero_c->mtu_exchange_params);
+    if (err) {
+        LOG_WRN("MTU exchange failed to start (err %d)", err);
+    }
+
+    return err;
+}
+
+uint16_t bt_sphero_client_get_max_payload(const struct bt_sphero_client* sphero_c)
+{
+    return sphero_c->max_payload;
+}
+
+int bt_sphero_client_request_link(struct bt_sphero_client* sphero_c, const struct bt_sphero_link_param* param)
+{
+    struct bt_le_conn_param conn_param = {
+        .interval_min = param->interval,
+        .interval_max = param->interval,
+        .latency = param->latency,
+        .timeout = param->timeout,
+    };
+    struct bt_conn_le_phy_param phy_param = {
+        .options = BT_CONN_LE_PHY_OPT_NONE,
+        .pref_tx_phy = param->phy,
+        .pref_rx_phy = param->phy,
+    };
+    int err;
+
+    if (!sphero_c->conn) {
+        return -ENOTCONN;
+    }
+
+    err = bt_conn_le_param_update(sphero_c->conn, &conn_param);
+
+    /* -EALREADY if the link was created with these parameters */
+    if (err && err != -EALREADY) {
+        LOG_WRN("Connection parameter update failed to start (err %d)", err);
+        return err;
+    }
+
+    if (!param->phy) {
+        return 0;
+    }
+
+    err = bt_conn_le_phy_update(sphero_c->conn, &phy_param);
+
+    if (err && err != -EALREADY) {
+        LOG_WRN("PHY update failed to start (err %d)", err);
         return err;
     }
 
+    return 0;
+}
+
+int bt_sphero_client_get_stats(const struct bt_sphero_client* sphero_c, struct bt_sphero_client_stats* stats)
+{
+    struct bt_conn_info info;
+    int err;
+
+    memset(stats, 0, sizeof(*stats));
+
+    stats->bytes_sent = atomic_get(&sphero_c->counters.bytes_sent);
+    stats->writes_sent = atomic_get(&sphero_c->counters.writes_sent);
+    stats->write_errors = atomic_get(&sphero_c->counters.write_errors);
+    stats->notifications = atomic_get(&sphero_c->counters.notifications);
+    stats->bytes_received = atomic_get(&sphero_c->counters.bytes_received);
+    stats->tx_queue_depth = bt_sphero_client_tx_queue_depth(sphero_c);
+    stats->max_payload = bt_sphero_client_get_max_payload(sphero_c);
+
     if (!sphero_c->conn) {
         return -ENOTCONN;
     }
 
-    if (atomic_test_and_set_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING)) {
-        return -EALREADY;
+    err = bt_conn_get_info(sphero_c->conn, &info);
+    if (err) {
+        return err;
     }
 
-    sphero_c->sphero_packet_write_params.func = on_sent;
-    sphero_c->sphero_packet_write_params.handle = sphero_c->handles.packets;
-    sphero_c->sphero_packet_write_params.offset = 0;
-    sphero_c->sphero_packet_write_params.data = data;
-    sphero_c->sphero_packet_write_params.length = len;
+    stats->interval = info.le.interval;
+    stats->latency = info.le.latency;
+    stats->timeout = info.le.timeout;
+    stats->tx_phy = info.le.phy->tx_phy;
+    stats->rx_phy = info.le.phy->rx_phy;
 
-    err = bt_gatt_write(sphero_c->conn, &sphero_c->sphero_packet_write_params);
+    return 0;
+}
+
+int bt_sphero_conn_read_rssi(struct bt_conn* conn, int8_t* rssi)
+{
+    struct bt_hci_cp_read_rssi* cp;
+    struct bt_hci_rp_read_rssi* rp;
+    struct net_buf* rsp = NULL;
+    struct net_buf* buf;
+    uint16_t handle;
+    int err;
+
+    err = bt_hci_get_conn_handle(conn, &handle);
     if (err) {
-        atomic_clear_bit(&sphero_c->state, SPHERO_C_WRITE_PENDING);
+        return err;
     }
 
-    return err;
+    buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->handle = sys_cpu_to_le16(handle);
+
+    err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+    if (err) {
+        LOG_WRN("Reading RSSI failed (err %d)", err);
+        return err;
+    }
+
+    rp = (struct bt_hci_rp_read_rssi*)rsp->data;
+    *rssi = rp->rssi;
+
+    net_buf_unref(rsp);
+
+    return 0;
 }
 
 int bt_sphero_handles_assign(struct bt_gatt_dm* dm, struct bt_sphero_client* sphero_c)
@@ -116,7 +757,7 @@ int bt_sphero_handles_assign(struct bt_gatt_dm* dm, struct bt_sphero_client* sph
     }
 
     LOG_DBG("Getting handles for Sphero Service");
-    memset(&sphero_c->handles, 0xFF, sizeof(&sphero_c->handles));
+    memset(&sphero_c->handles, 0xFF, sizeof(sphero_c->handles));
 
     /* Sphero Packets characteristic */
 
@@ -148,9 +789,41 @@ int bt_sphero_handles_assign(struct bt_gatt_dm* dm, struct bt_sphero_client* sph
 
     /* Assign connection instance */
     sphero_c->conn = bt_gatt_dm_conn_get(dm);
+    sphero_c->handles_cached = false;
     return 0;
 }
 
+int bt_sphero_handles_set(struct bt_sphero_client* sphero_c, struct bt_conn* conn, const struct bt_sphero_client_handles* handles)
+{
+    if (!sphero_c || !conn || !handles) {
+        return -EINVAL;
+    }
+
+    sphero_c->handles = *handles;
+    sphero_c->handles_cached = true;
+
+    /* Assign connection instance */
+    sphero_c->conn = conn;
+    return 0;
+}
+
+static void on_subscribed(struct bt_conn* conn, uint8_t err, struct bt_gatt_subscribe_params* params)
+{
+    struct bt_sphero_client* sphero_c;
+
+    // Retrieve Sphero Client module context
+    sphero_c = CONTAINER_OF(params, struct bt_sphero_client, sphero_packet_subscribe_params);
+
+    if (err) {
+        LOG_ERR("Subscribe rejected by peer (err %u)", err);
+        atomic_clear_bit(&sphero_c->state, SPHERO_C_NOTIF_ENABLED);
+    }
+
+    if (sphero_c->cb.subscribed) {
+        sphero_c->cb.subscribed(sphero_c, err);
+    }
+}
+
 int bt_sphero_subscribe(struct bt_sphero_client* sphero_c, bt_sphero_received_cb_t* received_cb, void* context)
 {
     int err;
@@ -167,6 +840,7 @@ int bt_sphero_subscribe(struct bt_sphero_client* sphero_c, bt_sphero_received_cb
     // Setup the subscribe params
 
     sphero_c->sphero_packet_subscribe_params.notify = on_received;
+    sphero_c->sphero_packet_subscribe_params.subscribe = on_subscribed;
     sphero_c->sphero_packet_subscribe_params.value = BT_GATT_CCC_NOTIFY;
     sphero_c->sphero_packet_subscribe_params.value_handle = sphero_c->handles.packets;
     sphero_c->sphero_packet_subscribe_params.ccc_handle = sphero_c->handles.packets_ccc;
@@ -181,4 +855,4 @@ int bt_sphero_subscribe(struct bt_sphero_client* sphero_c, bt_sphero_received_cb
     }
 
     return err;
-}
\ No newline at end of file
+}
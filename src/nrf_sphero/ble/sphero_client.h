@@ -9,6 +9,7 @@ extern "C" {
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/bluetooth/uuid.h>
+#include <zephyr/kernel.h>
 
 /**
  * Definitions of Sphero BOLT UUIDs
@@ -32,6 +33,143 @@ struct bt_sphero_client_handles {
     uint16_t packets_ccc;
 };
 
+/**
+ * @brief Largest write payload before the ATT MTU has been exchanged (default ATT MTU of 23 minus the 3 byte header)
+ */
+#define BT_SPHERO_DEFAULT_PAYLOAD 20
+
+/**
+ * @brief How data is written to the Sphero Packets characteristic
+ */
+enum bt_sphero_write_mode {
+    /** ATT Write Request. Waits for the Write Response before the next write can start */
+    BT_SPHERO_WRITE_WITH_RSP,
+    /** ATT Write Command. Several can be sent per connection event */
+    BT_SPHERO_WRITE_WITHOUT_RSP,
+};
+
+/**
+ * @brief Size of the data in a TX buffer. Large enough for the largest encoded Sphero packet
+ */
+#define BT_SPHERO_TX_BUF_SIZE 258
+
+/**
+ * @brief Number of TX buffers shared by all connections
+ */
+#define BT_SPHERO_TX_BUF_COUNT 32
+
+/**
+ * @brief Maximum writes without response per connection waiting for their completion callback
+ */
+#define BT_SPHERO_MAX_NO_RSP_PENDING 4
+
+/**
+ * @brief Default time to wait for a free TX buffer
+ */
+#define BT_SPHERO_TX_ALLOC_TIMEOUT_MS 400
+
+/**
+ * @brief How long the TX pipeline may have packets outstanding without completing any before it counts as stalled
+ */
+#define BT_SPHERO_STALL_TIMEOUT_MS 1000
+
+/**
+ * @brief How often each connection's TX pipeline is checked for stalls while it has packets outstanding
+ */
+#define BT_SPHERO_WATCHDOG_PERIOD_MS 250
+
+/**
+ * @brief Stalls in a row recovered by dropping the queued packets before the connection is dropped instead
+ */
+#define BT_SPHERO_MAX_RESYNCS 2
+
+/**
+ * @brief Priority of the work queue which drains the TX queues
+ */
+#define BT_SPHERO_TX_QUEUE_PRIORITY 5
+
+/**
+ * @brief Connection parameters and PHY to request for a link
+ */
+struct bt_sphero_link_param {
+    /** Connection interval in 1.25 ms units */
+    uint16_t interval;
+
+    /** Peripheral latency in connection events */
+    uint16_t latency;
+
+    /** Supervision timeout in 10 ms units */
+    uint16_t timeout;
+
+    /** Preferred PHYs (BT_GAP_LE_PHY_*), 0 to leave the PHY as it is */
+    uint8_t phy;
+};
+
+/**
+ * @brief An encoded packet waiting to be sent. Owned by the TX queue once enqueued
+ */
+struct bt_sphero_tx_buf {
+    /** Reserved for the k_fifo */
+    void* fifo_reserved;
+    /** How the packet is written */
+    enum bt_sphero_write_mode mode;
+    /** Length of the data */
+    uint16_t len;
+    /** Number of packets in the data, more than one once batched */
+    uint16_t packets;
+    uint8_t data[BT_SPHERO_TX_BUF_SIZE];
+};
+
+/**
+ * @brief Counters of a connection, reset every time the Sphero connects
+ */
+struct bt_sphero_client_counters {
+    /** Bytes written to the Sphero Packets characteristic */
+    atomic_t bytes_sent;
+
+    /** Writes issued, each carrying one or more packets or part of a packet */
+    atomic_t writes_sent;
+
+    /** Writes which failed, either rejected by the stack or answered with an ATT error */
+    atomic_t write_errors;
+
+    /** Notifications received */
+    atomic_t notifications;
+
+    /** Bytes received in notifications */
+    atomic_t bytes_received;
+};
+
+/**
+ * @brief Snapshot of the counters and link parameters of a connection
+ */
+struct bt_sphero_client_stats {
+    uint32_t bytes_sent;
+    uint32_t writes_sent;
+    uint32_t write_errors;
+    uint32_t notifications;
+    uint32_t bytes_received;
+
+    /** Packets waiting in the TX queue */
+    uint32_t tx_queue_depth;
+
+    /** Largest payload of a single write, see bt_sphero_client_get_max_payload */
+    uint16_t max_payload;
+
+    /** Connection interval in 1.25 ms units */
+    uint16_t interval;
+
+    /** Peripheral latency in connection events */
+    uint16_t latency;
+
+    /** Supervision timeout in 10 ms units */
+    uint16_t timeout;
+
+    /** Current PHYs (BT_GAP_LE_PHY_*) */
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+};
+
 struct bt_sphero_client;
 
 typedef uint8_t(bt_sphero_received_cb_t)(struct bt_sphero_client* sphero, const uint8_t* data, uint16_t len, void* context);
@@ -58,7 +196,8 @@ struct bt_sphero_client_cb {
 
     /** @brief Data sent callback
      *
-     * Data sent as a write to the sphero packet characteristic
+     * Called once every write of an enqueued packet has completed. Packets batched into the same write are
+     * reported together
      *
      * @param[in] sphero Sphero Client instance
      * @param[in] err ATT error code
@@ -67,6 +206,27 @@ struct bt_sphero_client_cb {
      */
     void (*sent)(struct bt_sphero_client* sphero, uint8_t err, const uint8_t* data, uint16_t len);
 
+    /** @brief Subscription result callback
+     *
+     * Called once the peer has answered the CCC write of bt_sphero_subscribe
+     *
+     * @param[in] sphero Sphero Client instance
+     * @param[in] err ATT error code
+     */
+    void (*subscribed)(struct bt_sphero_client* sphero, uint8_t err);
+
+    /** @brief TX stall callback
+     *
+     * Called from the TX work queue when no packet has completed for BT_SPHERO_STALL_TIMEOUT_MS while some were
+     * outstanding. Queued packets are dropped so the link catches up once the writes in flight complete. A pending
+     * Write Request can't be dropped, so the connection is dropped instead, as it is after BT_SPHERO_MAX_RESYNCS stalls
+     * in a row
+     *
+     * @param[in] sphero Sphero Client instance
+     * @param[in] disconnecting Whether the connection is being dropped
+     */
+    void (*stalled)(struct bt_sphero_client* sphero, bool disconnecting);
+
     /** @brief Sphero Packet notifcations disabled callback
      *
      * @param[in] sphero Sphero Client instance
@@ -82,14 +242,74 @@ struct bt_sphero_client {
 
     atomic_t state;
 
-    /** @brief Semaphore for if is sending BLE data */
-    struct k_mutex sending;
+    /** @brief Packets waiting to be sent */
+    struct k_fifo tx_queue;
+
+    /** @brief Number of packets in tx_queue */
+    atomic_t tx_depth;
+
+    /** @brief Latest-wins packet, taken ahead of tx_queue */
+    atomic_ptr_t tx_latest;
+
+    /** @brief Packets accepted by tx_queue or tx_latest since init */
+    atomic_t tx_enqueued;
+
+    /** @brief Packets sent, dropped or replaced since init */
+    atomic_t tx_completed;
+
+    /** @brief Raised every time tx_completed changes, and once more by bt_sphero_client_tx_close */
+    struct k_poll_signal tx_signal;
+
+    /** @brief Packet currently being written, split over several writes if longer than max_payload */
+    struct bt_sphero_tx_buf* tx_cur;
+
+    /** @brief Bytes of tx_cur already written */
+    uint16_t tx_offset;
+
+    /** @brief Drains tx_queue on the TX work queue */
+    struct k_work_delayable tx_work;
+
+    /**
+     * @brief Writes without response waiting for their completion callback
+     *
+     * Completions arrive in order so this is a ring indexed by no_rsp_head (completions) and no_rsp_tail (writes).
+     * An entry holds the packet if it was the last write of the packet, otherwise NULL. Changed under no_rsp_lock
+     * since completions run on the BT thread and writes on the TX work queue
+     */
+    struct bt_sphero_tx_buf* no_rsp_bufs[BT_SPHERO_MAX_NO_RSP_PENDING];
+    atomic_t no_rsp_head;
+    atomic_t no_rsp_tail;
+    struct k_spinlock no_rsp_lock;
+
+    /** @brief Checks the TX pipeline is making progress */
+    struct k_work_delayable watchdog_work;
+
+    /** @brief tx_completed when the watchdog last saw progress */
+    atomic_val_t watchdog_completed;
+
+    /** @brief Uptime when the watchdog last saw progress */
+    int64_t watchdog_progress;
+
+    /** @brief Stalls since the watchdog last saw progress */
+    uint8_t watchdog_stalls;
+
+    /** @brief Link statistics, see bt_sphero_client_get_stats */
+    struct bt_sphero_client_counters counters;
+
+    /** @brief Largest payload of a single write, set once the ATT MTU has been exchanged */
+    uint16_t max_payload;
+
+    /** GATT exchange parameters for the ATT MTU */
+    struct bt_gatt_exchange_params mtu_exchange_params;
 
     /**
      * Handles on the connected device that are needed to interact with it
      */
     struct bt_sphero_client_handles handles;
 
+    /** Whether handles came from the handle cache rather than discovery */
+    bool handles_cached;
+
     /** GATT subscribe parameters for Sphero Packet Characteristic */
     struct bt_gatt_subscribe_params sphero_packet_subscribe_params;
 
@@ -118,20 +338,151 @@ struct bt_sphero_client_init_param {
  */
 int bt_sphero_client_init(struct bt_sphero_client* sphero, const struct bt_sphero_client_init_param* init_param);
 
-/** @brief Send data to the Sphero
+/** @brief Allocate a TX buffer from the shared pool
  *
- * This function writes to the Sphero Packet Characteristic
+ * @param[in] timeout How long to wait for a buffer to become free
  *
- * @note This procedure is async. The data must remain valid while the function is active
+ * @return The buffer, or NULL if none became free
+ */
+struct bt_sphero_tx_buf* bt_sphero_client_tx_alloc(k_timeout_t timeout);
+
+/** @brief Return a TX buffer which wasn't enqueued to the shared pool
+ *
+ * @param[in] buf The buffer
+ */
+void bt_sphero_client_tx_free(struct bt_sphero_tx_buf* buf);
+
+/** @brief Queue a packet to be sent
+ *
+ * The queue takes ownership of the buffer and frees it once the last write of the packet has completed. Returns
+ * immediately, the queue is drained by a work queue as fast as the link allows. An idle link sends the packet
+ * straight away, otherwise packets queued while a write is in flight are packed into the next write when they fit
  *
  * @param[in, out] sphero Sphero Client instance
- * @param[in] data Data to be sent
- * @param[in] len Length of the data
+ * @param[in] buf The packet to send. Freed on error
  *
  * @retval 0 If successful
  *         Otherwise, a negative error code is returned
  */
-int bt_sphero_client_send(struct bt_sphero_client* sphero, const uint8_t* data, uint16_t len);
+int bt_sphero_client_tx_enqueue(struct bt_sphero_client* sphero, struct bt_sphero_tx_buf* buf);
+
+/** @brief Put a packet in the latest-wins slot of the connection
+ *
+ * The slot holds at most one packet. A packet which hasn't started being written yet is replaced (and freed) by
+ * the next one, so only the newest goes on air. The slot is sent ahead of the TX queue. Meant for setpoints,
+ * like drive commands, where an old value is worthless once a new one exists
+ *
+ * @param[in, out] sphero Sphero Client instance
+ * @param[in] buf The packet to send. Freed on error
+ *
+ * @retval 0 If the slot was empty
+ * @retval 1 If an unsent packet was replaced
+ *         Otherwise, a negative error code is returned
+ */
+int bt_sphero_client_tx_send_latest(struct bt_sphero_client* sphero, struct bt_sphero_tx_buf* buf);
+
+/** @brief Get the number of packets waiting in the TX queue
+ *
+ * @param[in] sphero Sphero Client instance
+ */
+uint32_t bt_sphero_client_tx_queue_depth(const struct bt_sphero_client* sphero);
+
+/** @brief Get the number of packets enqueued since init
+ *
+ * Once bt_sphero_client_tx_completed reaches the value read after enqueueing some packets, they have all finished
+ * provided nothing else was enqueued in the meantime. Wait on tx_signal for it to change
+ *
+ * @param[in] sphero Sphero Client instance
+ */
+uint32_t bt_sphero_client_tx_enqueued(const struct bt_sphero_client* sphero);
+
+/** @brief Get the number of packets sent, dropped or replaced since init
+ *
+ * @param[in] sphero Sphero Client instance
+ */
+uint32_t bt_sphero_client_tx_completed(const struct bt_sphero_client* sphero);
+
+/** @brief Get the number of free buffers in the shared TX pool */
+uint32_t bt_sphero_client_tx_bufs_free(void);
+
+/** @brief Refuse any more packets and wake everyone waiting on tx_signal
+ *
+ * Should be called as soon as the connection is lost. Doesn't block, so it's safe from BT callbacks
+ *
+ * @param[in, out] sphero Sphero Client instance
+ */
+void bt_sphero_client_tx_close(struct bt_sphero_client* sphero);
+
+/** @brief Check whether bt_sphero_client_tx_close has been called, after which queued packets won't complete
+ *
+ * @param[in] sphero Sphero Client instance
+ */
+bool bt_sphero_client_tx_closed(const struct bt_sphero_client* sphero);
+
+/** @brief Stop sending and free every queued packet
+ *
+ * Should be called when the connection is lost, before the Sphero Client instance is freed. Also stops the stall
+ * watchdog
+ *
+ * @param[in, out] sphero Sphero Client instance
+ */
+void bt_sphero_client_tx_flush(struct bt_sphero_client* sphero);
+
+/** @brief Negotiate a larger ATT MTU and LE data length with the Sphero
+ *
+ * Should be called once discovery has completed. Until the exchange finishes, or if the Sphero won't negotiate,
+ * writes are limited to BT_SPHERO_DEFAULT_PAYLOAD bytes
+ *
+ * @param[in, out] sphero Sphero Client instance
+ *
+ * @retval 0 If the exchange was started
+ *         Otherwise, a negative error code is returned
+ */
+int bt_sphero_client_exchange_mtu(struct bt_sphero_client* sphero);
+
+/** @brief Get the largest payload that can be sent in a single write
+ *
+ * @param[in] sphero Sphero Client instance
+ *
+ * @return The negotiated ATT MTU minus the ATT header, or BT_SPHERO_DEFAULT_PAYLOAD
+ */
+uint16_t bt_sphero_client_get_max_payload(const struct bt_sphero_client* sphero);
+
+/** @brief Request connection parameters and PHY for the link to the Sphero
+ *
+ * Both are negotiated by the controller in the background. The result is reported through the le_param_updated and
+ * le_phy_updated connection callbacks
+ *
+ * @param[in] sphero Sphero Client instance
+ * @param[in] param The parameters to request
+ *
+ * @retval 0 If the requests were started or the link already uses the parameters
+ *         Otherwise, a negative error code is returned
+ */
+int bt_sphero_client_request_link(struct bt_sphero_client* sphero, const struct bt_sphero_link_param* param);
+
+/** @brief Get the counters and current link parameters of the connection
+ *
+ * @param[in] sphero Sphero Client instance
+ * @param[out] stats Filled with the statistics
+ *
+ * @retval 0 If successful
+ *         Otherwise, a negative error code is returned. The counters are filled in regardless
+ */
+int bt_sphero_client_get_stats(const struct bt_sphero_client* sphero, struct bt_sphero_client_stats* stats);
+
+/** @brief Read the RSSI of a connection from the controller
+ *
+ * Blocks until the controller answers, so takes the connection rather than the Sphero Client instance. Don't call
+ * from the BT RX thread
+ *
+ * @param[in] conn The connection
+ * @param[out] rssi The RSSI in dBm
+ *
+ * @retval 0 If successful
+ *         Otherwise, a negative error code is returned
+ */
+int bt_sphero_conn_read_rssi(struct bt_conn* conn, int8_t* rssi);
 
 /** @brief Assign handles to Sphero Client instance
  *
@@ -148,6 +499,19 @@ int bt_sphero_client_send(struct bt_sphero_client* sphero, const uint8_t* data,
  */
 int bt_sphero_handles_assign(struct bt_gatt_dm* dm, struct bt_sphero_client* sphero);
 
+/** @brief Assign previously discovered handles to Sphero Client instance
+ *
+ * Used instead of bt_sphero_handles_assign to skip discovery when the handles of the Sphero are already known
+ *
+ * @param[in, out] sphero Sphero Client instance
+ * @param[in] conn Connection to the Sphero
+ * @param[in] handles The known handles
+ *
+ * @retval 0 If successful
+ *         Otherwise, a negative error code is returned
+ */
+int bt_sphero_handles_set(struct bt_sphero_client* sphero, struct bt_conn* conn, const struct bt_sphero_client_handles* handles);
+
 /** @brief Request Sphero to start sending notifcations with packets
  *
  * Enables notifications for the Sphero Packet Characteristic at the peer
@@ -8,6 +8,10 @@
 
 LOG_MODULE_REGISTER(IO, LOG_LEVEL_DBG);
 
+// Animation id, fps, fade, palette size and frame count come before the palette and frame indexes
+static_assert(PACKET_OVERHEAD_SIZE + 6 + 3 * IO_MAX_PALETTE_COLORS + 2 * IO_MAX_ANIMATION_FRAMES <= PACKET_MAX_SIZE,
+    "The largest animation must fit in a packet");
+
 const Packet IO::fill_led_matrix(Sphero& sphero, uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, RGBColor color, uint8_t tid)
 {
     std::vector<unsigned char> data = { x1, y1, x2, y2, color.red, color.green, color.blue };
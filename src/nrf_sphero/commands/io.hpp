@@ -8,6 +8,16 @@
 
 #define IO_DID 26
 
+/**
+ * Most colors in an animation palette, since frames index it with 4 bits
+ */
+#define IO_MAX_PALETTE_COLORS 16
+
+/**
+ * Most frames in an animation which still fit in a packet with a full palette
+ */
+#define IO_MAX_ANIMATION_FRAMES 32
+
 class IO : public Commands {
 public:
     /**
@@ -74,6 +84,7 @@ public:
      * @param[in] frame_indexes The indexes of frames in the animation
      * @param[in] tid The target id for the packet (optional)
      *
+     * @note At most IO_MAX_PALETTE_COLORS colors and IO_MAX_ANIMATION_FRAMES frames fit in the packet
      */
     static const Packet save_compressed_frame_animation(Sphero& sphero, uint8_t animation_id, uint8_t fps, bool fade_animation, std::vector<RGBColor> palette, std::vector<uint16_t> frame_indexes, uint8_t tid = 0);
 
@@ -1,14 +1,13 @@
 #include "packet.hpp"
 #include <numeric>
-#include <stdexcept>
 #include <vector>
 #include <zephyr/logging/log.h>
 
 LOG_MODULE_REGISTER(Packet, LOG_LEVEL_DBG);
 
-uint8_t packet_chk(std::vector<unsigned char> payload)
+uint8_t packet_chk(const uint8_t* payload, size_t len)
 {
-    return 0xff - (std::accumulate(payload.begin(), payload.end(), 0) & 0xff);
+    return 0xff - (std::accumulate(payload, payload + len, 0) & 0xff);
 }
 
 PacketFlags operator&(PacketFlags lhs, PacketFlags rhs)
@@ -37,155 +36,142 @@ Packet::Packet(PacketFlags flags, uint8_t did, uint8_t cid, uint8_t seq, uint8_t
     , err(err)
     , data(data) {};
 
-std::vector<unsigned char> Packet::build() const
+/**
+ * Writes a byte to the buffer, escaping it if required
+ *
+ * @returns false if the buffer is too small
+ */
+static bool put_escaped(uint8_t* buffer, size_t capacity, size_t& offset, uint8_t byte)
 {
-    std::vector<unsigned char> packet = { static_cast<unsigned char>(flags) };
+    uint8_t escaped;
+
+    switch (byte) {
+    case static_cast<uint8_t>(PacketEncoding::start):
+        escaped = static_cast<uint8_t>(PacketEncoding::escaped_start);
+        break;
+    case static_cast<uint8_t>(PacketEncoding::end):
+        escaped = static_cast<uint8_t>(PacketEncoding::escaped_end);
+        break;
+    case static_cast<uint8_t>(PacketEncoding::escape):
+        escaped = static_cast<uint8_t>(PacketEncoding::escaped_escape);
+        break;
+    default:
+        if (offset + 1 > capacity) {
+            return false;
+        }
 
-    if ((flags & PacketFlags::has_target_id) != PacketFlags::none) {
-        packet.push_back(tid);
+        buffer[offset++] = byte;
+        return true;
     }
 
-    if ((flags & PacketFlags::has_source_id) != PacketFlags::none) {
-        packet.push_back(sid);
+    if (offset + 2 > capacity) {
+        return false;
     }
 
-    packet.push_back(did);
-    packet.push_back(cid);
-    packet.push_back(seq);
+    buffer[offset++] = static_cast<uint8_t>(PacketEncoding::escape);
+    buffer[offset++] = escaped;
 
-    if ((flags & PacketFlags::is_response) != PacketFlags::none) {
-        packet.push_back(static_cast<unsigned char>(err));
-    }
+    return true;
+}
 
-    if (data.size() > 0) {
-        packet.insert(packet.end(), data.begin(), data.end());
-    }
+size_t Packet::encode(uint8_t* buffer, size_t capacity) const
+{
+    size_t offset = 0;
+    uint8_t sum = 0;
+    bool fits = capacity > 0;
 
-    packet.push_back(packet_chk(packet));
-
-    std::vector<unsigned char> escaped_packet = { static_cast<unsigned char>(PacketEncoding::start) };
-
-    for (auto byte : packet) {
-
-        switch (byte) {
-        case static_cast<unsigned char>(PacketEncoding::start):
-            escaped_packet.push_back(static_cast<unsigned char>(PacketEncoding::escape));
-            escaped_packet.push_back(static_cast<unsigned char>(PacketEncoding::escaped_start));
-            break;
-        case static_cast<unsigned char>(PacketEncoding::end):
-            escaped_packet.push_back(static_cast<unsigned char>(PacketEncoding::escape));
-            escaped_packet.push_back(static_cast<unsigned char>(PacketEncoding::escaped_end));
-            break;
-        case static_cast<unsigned char>(PacketEncoding::escape):
-            escaped_packet.push_back(static_cast<unsigned char>(PacketEncoding::escape));
-            escaped_packet.push_back(static_cast<unsigned char>(PacketEncoding::escaped_escape));
-            break;
-        default:
-            escaped_packet.push_back(byte);
-            break;
-        }
+    if (!fits) {
+        return 0;
     }
 
-    escaped_packet.push_back(static_cast<unsigned char>(PacketEncoding::end));
-
-    return escaped_packet;
-};
+    buffer[offset++] = static_cast<uint8_t>(PacketEncoding::start);
 
-std::vector<unsigned char> Packet::unescape_data(std::vector<unsigned char> data)
-{
-    std::vector<unsigned char> unescaped_data;
-
-    for (size_t i = 0; i < data.size(); i++) {
-        if (data[i] == static_cast<unsigned char>(PacketEncoding::escape)) {
-            switch (data[i + 1]) {
-            case static_cast<unsigned char>(PacketEncoding::escaped_start):
-                unescaped_data.push_back(static_cast<unsigned char>(PacketEncoding::start));
-                break;
-            case static_cast<unsigned char>(PacketEncoding::escaped_end):
-                unescaped_data.push_back(static_cast<unsigned char>(PacketEncoding::end));
-                break;
-            case static_cast<unsigned char>(PacketEncoding::escaped_escape):
-                unescaped_data.push_back(static_cast<unsigned char>(PacketEncoding::escape));
-                break;
-            default:
-                LOG_ERR("Invalid escape sequence: %d", data[i + 1]);
-                return {};
-            }
-            i++;
-        } else {
-            unescaped_data.push_back(data[i]);
-        }
-    }
+    auto put = [&](uint8_t byte) {
+        sum += byte;
+        fits = fits && put_escaped(buffer, capacity, offset, byte);
+    };
 
-    return unescaped_data;
-}
+    put(static_cast<uint8_t>(flags));
 
-const Packet Packet::parse_response(std::vector<unsigned char> data)
-{
-    if (data.empty()) {
-        LOG_ERR("Empty data");
-        throw std::runtime_error("Empty data");
+    if ((flags & PacketFlags::has_target_id) != PacketFlags::none) {
+        put(tid);
     }
 
-    uint8_t sop = data[0];
-    uint8_t eop = data[data.size() - 1];
+    if ((flags & PacketFlags::has_source_id) != PacketFlags::none) {
+        put(sid);
+    }
 
-    data.erase(data.begin());
-    data.pop_back();
+    put(did);
+    put(cid);
+    put(seq);
 
-    if (sop != static_cast<uint8_t>(PacketEncoding::start)) {
-        LOG_ERR("Invalid start of packet: %d", sop);
-        throw std::runtime_error("Invalid start of packet");
+    if ((flags & PacketFlags::is_response) != PacketFlags::none) {
+        put(static_cast<uint8_t>(err));
     }
 
-    if (eop != static_cast<uint8_t>(PacketEncoding::end)) {
-        LOG_ERR("Invalid end of packet: %d", eop);
-        throw std::runtime_error("Invalid end of packet");
+    for (auto byte : data) {
+        put(byte);
     }
 
-    auto unescaped_data = Packet::unescape_data(data);
-
-    unsigned char checksum = unescaped_data[unescaped_data.size() - 1];
-    unescaped_data.pop_back();
+    fits = fits && put_escaped(buffer, capacity, offset, 0xff - sum);
 
-    if (checksum != packet_chk(unescaped_data)) {
-        LOG_ERR("Invalid checksum: %d", checksum);
-        throw std::runtime_error("Invalid checksum");
+    if (!fits || offset + 1 > capacity) {
+        LOG_ERR("Packet does not fit in %zu byte buffer", capacity);
+        return 0;
     }
 
-    PacketFlags flags = static_cast<PacketFlags>(unescaped_data[0]);
-    unescaped_data.erase(unescaped_data.begin());
+    buffer[offset++] = static_cast<uint8_t>(PacketEncoding::end);
 
-    uint8_t tid = 0;
-    if ((flags & PacketFlags::has_target_id) != PacketFlags::none) {
-        tid = unescaped_data[0];
-        unescaped_data.erase(unescaped_data.begin());
-    }
+    return offset;
+}
 
-    uint8_t sid = 0;
-    if ((flags & PacketFlags::has_source_id) != PacketFlags::none) {
-        sid = unescaped_data[0];
-        unescaped_data.erase(unescaped_data.begin());
+void Packet::set_response_policy(ResponsePolicy policy)
+{
+    flags = static_cast<PacketFlags>(static_cast<uint8_t>(flags) & ~static_cast<uint8_t>(PacketFlags::requests_response | PacketFlags::requests_only_error_response));
+
+    switch (policy) {
+    case ResponsePolicy::none:
+        break;
+    case ResponsePolicy::errors_only:
+        // Only valid alongside requests_response
+        flags |= PacketFlags::requests_response | PacketFlags::requests_only_error_response;
+        break;
+    case ResponsePolicy::full:
+        flags |= PacketFlags::requests_response;
+        break;
     }
+}
 
-    uint8_t did = unescaped_data[0];
-    uint8_t cid = unescaped_data[1];
-    uint8_t seq = unescaped_data[2];
-
-    PacketError err = PacketError::success;
-
-    if ((flags & PacketFlags::is_response) != PacketFlags::none) {
-        err = static_cast<PacketError>(unescaped_data[3]);
-        unescaped_data.erase(unescaped_data.begin());
+ResponsePolicy Packet::response_policy() const
+{
+    if ((flags & PacketFlags::requests_response) == PacketFlags::none) {
+        return ResponsePolicy::none;
     }
 
-    unescaped_data.erase(unescaped_data.begin(), unescaped_data.begin() + 3);
+    if ((flags & PacketFlags::requests_only_error_response) != PacketFlags::none) {
+        return ResponsePolicy::errors_only;
+    }
 
-    return Packet(flags, did, cid, seq, tid, sid, err, unescaped_data);
+    return ResponsePolicy::full;
 }
 
 const uint32_t Packet::id() const
+{
+    return packet_id(did, cid, seq);
+}
+
+uint32_t packet_id(uint8_t did, uint8_t cid, uint8_t seq)
 {
     uint32_t uniqueID = (static_cast<uint32_t>(did) << 16) | (static_cast<uint32_t>(cid) << 8) | static_cast<uint32_t>(seq);
     return uniqueID;
+}
+
+uint32_t PacketView::id() const
+{
+    return packet_id(did, cid, seq);
+}
+
+Packet PacketView::to_packet() const
+{
+    return Packet(flags, did, cid, seq, tid, sid, err, std::vector<unsigned char>(data, data + len));
 }
\ No newline at end of file
@@ -2,11 +2,38 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <stdexcept>
 #include <vector>
 
-uint8_t packet_chk(std::vector<unsigned char> payload);
+/**
+ * Largest unescaped packet (flags through checksum) that can be sent or received
+ *
+ * @note Fits the largest command sent, an animation of IO_MAX_ANIMATION_FRAMES frames
+ */
+#ifndef PACKET_MAX_SIZE
+#define PACKET_MAX_SIZE 128
+#endif
+
+/**
+ * Bytes of a command packet other than its data: flags, tid, sid, did, cid, seq and checksum
+ */
+#define PACKET_OVERHEAD_SIZE 7
+
+/**
+ * Largest encoded (escaped, framed) packet that can be sent
+ *
+ * @note Worst case every byte of the packet needs escaping, plus SOP and EOP
+ */
+#define PACKET_MAX_ENCODED_SIZE (2 * PACKET_MAX_SIZE + 2)
+
+/**
+ * Buffer large enough to hold any encoded packet
+ */
+typedef std::array<uint8_t, PACKET_MAX_ENCODED_SIZE> EncodedPacket;
+
+uint8_t packet_chk(const uint8_t* payload, size_t len);
 
 /**
  * Packet flags
@@ -32,6 +59,18 @@ PacketFlags operator|(PacketFlags lhs, PacketFlags rhs);
 // Define bitwise OR and assignment operator for PacketFlags
 PacketFlags& operator|=(PacketFlags& lhs, PacketFlags rhs);
 
+/**
+ * Which responses a command asks the Sphero for
+ */
+enum class ResponsePolicy : uint8_t {
+    /* No response at all */
+    none,
+    /* A response only if the command fails (requests_only_error_response) */
+    errors_only,
+    /* A response to every command */
+    full,
+};
+
 /**
  * Packet Encoding
  */
@@ -62,6 +101,63 @@ enum class PacketError : unsigned char {
     target_unavailable = 0x0a
 };
 
+/**
+ * Reasons a received packet can be rejected
+ */
+enum class PacketParseError : uint8_t {
+    /* No data to parse */
+    empty,
+    /* Data ended before the end of packet */
+    incomplete,
+    /* Start of packet seen before the end of the previous packet */
+    unexpected_start,
+    /* Escape byte followed by an unknown value */
+    invalid_escape,
+    /* Fewer bytes than the smallest valid packet */
+    too_short,
+    /* More bytes than PACKET_MAX_SIZE */
+    too_long,
+    /* Checksum did not match */
+    invalid_checksum,
+    /* Number of error kinds, not an error */
+    count
+};
+
+/**
+ * Computes an id for a packet from its device id, command id and sequence number
+ */
+uint32_t packet_id(uint8_t did, uint8_t cid, uint8_t seq);
+
+class Packet;
+
+/**
+ * A parsed packet whose data is owned by someone else (e.g. the PacketCollector)
+ *
+ * @note Only valid for as long as the callback it is passed to is running. Use to_packet() to keep it
+ */
+struct PacketView {
+    PacketFlags flags;
+    uint8_t did;
+    uint8_t cid;
+    uint8_t seq;
+    uint8_t tid;
+    uint8_t sid;
+    PacketError err;
+    /* Data - Points into the buffer of the owner */
+    const uint8_t* data;
+    size_t len;
+
+    /**
+     * Computes an id for the packet
+     */
+    uint32_t id() const;
+
+    /**
+     * Copies the view into a Packet which owns its data
+     */
+    Packet to_packet() const;
+};
+
 /**
  * A Sphero BLE Packet
  *
@@ -69,9 +165,6 @@ enum class PacketError : unsigned char {
     [SOP, FLAGS, TID (optional), SID (optional), DID, CID, SEQ, ERR (at response), DATA..., CHK, EOP]
 */
 class Packet {
-private:
-    static std::vector<unsigned char> unescape_data(std::vector<unsigned char> data);
-
 public:
     /* Packet Constructor */
     Packet(PacketFlags flags, uint8_t did, uint8_t cid, uint8_t seq, uint8_t tid, uint8_t sid, PacketError err, std::vector<unsigned char> data);
@@ -91,16 +184,28 @@ public:
     std::vector<unsigned char> data;
     PacketError err;
 
-    std::vector<unsigned char> build() const;
+    /**
+     * Encodes the packet into a caller supplied buffer
+     *
+     * Computes the checksum, escapes the bytes and adds SOP/EOP in a single pass without allocating
+     *
+     * @param[out] buffer The buffer to write the encoded packet into
+     * @param[in] capacity The size of the buffer
+     * @return The number of bytes written, or 0 if the buffer is too small
+     */
+    size_t encode(uint8_t* buffer, size_t capacity) const;
 
     /**
-     * Parses the response data and returns a Packet.
+     * Sets which responses the packet asks the Sphero for
      *
-     * @param data The data to be parsed.
-     * @throws std::runtime_error If the data is empty or other parsing errors occur.
-     * @return The parsed Packet.
+     * @param[in] policy The responses to ask for
+     */
+    void set_response_policy(ResponsePolicy policy);
+
+    /**
+     * Gets which responses the packet asks the Sphero for
      */
-    static const Packet parse_response(std::vector<unsigned char> data) noexcept(false);
+    ResponsePolicy response_policy() const;
 
     /**
      * Computes an id for the packet
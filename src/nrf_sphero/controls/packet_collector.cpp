@@ -1,31 +1,192 @@
 #include "packet_collector.hpp"
 #include "packet.hpp"
-#include <vector>
-#include <zephyr/debug/thread_analyzer.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
 LOG_MODULE_REGISTER(PacketCollector, LOG_LEVEL_DBG);
 
+/* Smallest valid packet is FLAGS, DID, CID, SEQ, CHK */
+#define PACKET_MIN_SIZE 5
+
 PacketCollector::PacketCollector(PacketCollectorCallbackType cb)
 {
     callback = cb;
-
-    received_data = std::vector<uint8_t>();
 }
 
 void PacketCollector::add_packet(const uint8_t* data, uint16_t len)
 {
     for (size_t i = 0; i < len; i++) {
-        received_data.push_back(data[i]);
-        if (data[i] == static_cast<uint8_t>(PacketEncoding::end)) {
-            if (received_data.size() < 6) {
-                LOG_ERR("Very small packet");
-                return;
-            }
-            auto packet = Packet::parse_response(received_data);
-            callback(packet);
-            received_data.clear();
+        add_byte(data[i]);
+    }
+}
+
+void PacketCollector::add_byte(uint8_t byte)
+{
+    switch (state) {
+    case State::WAIT_START:
+        // Anything before a SOP is garbage
+        if (byte == static_cast<uint8_t>(PacketEncoding::start)) {
+            reset();
+            state = State::BODY;
+        }
+        break;
+    case State::BODY:
+        switch (byte) {
+        case static_cast<uint8_t>(PacketEncoding::start):
+            LOG_WRN("Start of packet before end of packet, dropping %zu bytes", length);
+            fail(PacketParseError::unexpected_start);
+            state = State::BODY;
+            break;
+        case static_cast<uint8_t>(PacketEncoding::end):
+            finish();
+            break;
+        case static_cast<uint8_t>(PacketEncoding::escape):
+            state = State::ESCAPE;
+            break;
+        default:
+            push(byte);
+            break;
+        }
+        break;
+    case State::ESCAPE:
+        state = State::BODY;
+
+        switch (byte) {
+        case static_cast<uint8_t>(PacketEncoding::escaped_start):
+            push(static_cast<uint8_t>(PacketEncoding::start));
+            break;
+        case static_cast<uint8_t>(PacketEncoding::escaped_end):
+            push(static_cast<uint8_t>(PacketEncoding::end));
+            break;
+        case static_cast<uint8_t>(PacketEncoding::escaped_escape):
+            push(static_cast<uint8_t>(PacketEncoding::escape));
+            break;
+        default:
+            LOG_ERR("Invalid escape sequence: %d", byte);
+            fail(PacketParseError::invalid_escape);
+            break;
+        }
+        break;
+    }
+}
+
+void PacketCollector::push(uint8_t byte)
+{
+    if (length >= buffer.size()) {
+        LOG_ERR("Packet larger than %zu bytes", buffer.size());
+        fail(PacketParseError::too_long);
+        return;
+    }
+
+    if (length == 0) {
+        // Flags tell us how long the header is
+        PacketFlags flags = static_cast<PacketFlags>(byte);
+
+        header_length = 4;
+
+        if ((flags & PacketFlags::has_target_id) != PacketFlags::none) {
+            header_length++;
+        }
+
+        if ((flags & PacketFlags::has_source_id) != PacketFlags::none) {
+            header_length++;
         }
+
+        if ((flags & PacketFlags::is_response) != PacketFlags::none) {
+            header_length++;
+        }
+    }
+
+    buffer[length++] = byte;
+    sum += byte;
+}
+
+void PacketCollector::finish()
+{
+    if (length < PACKET_MIN_SIZE || length < header_length + 1) {
+        LOG_ERR("Very small packet");
+        fail(PacketParseError::too_short);
+        return;
+    }
+
+    // The checksum is chosen so that all bytes including it sum to 0xff
+    if (sum != 0xff) {
+        LOG_ERR("Invalid checksum: %d", buffer[length - 1]);
+        fail(PacketParseError::invalid_checksum);
+        return;
+    }
+
+    PacketView packet;
+    size_t offset = 0;
+
+    packet.flags = static_cast<PacketFlags>(buffer[offset++]);
+
+    packet.tid = 0;
+    if ((packet.flags & PacketFlags::has_target_id) != PacketFlags::none) {
+        packet.tid = buffer[offset++];
+    }
+
+    packet.sid = 0;
+    if ((packet.flags & PacketFlags::has_source_id) != PacketFlags::none) {
+        packet.sid = buffer[offset++];
+    }
+
+    packet.did = buffer[offset++];
+    packet.cid = buffer[offset++];
+    packet.seq = buffer[offset++];
+
+    packet.err = PacketError::success;
+    if ((packet.flags & PacketFlags::is_response) != PacketFlags::none) {
+        packet.err = static_cast<PacketError>(buffer[offset++]);
+    }
+
+    packet.data = buffer.data() + header_length;
+    packet.len = length - header_length - 1;
+
+    packet_count++;
+
+    callback(packet);
+
+    reset();
+}
+
+void PacketCollector::reset()
+{
+    state = State::WAIT_START;
+    length = 0;
+    header_length = 0;
+    sum = 0;
+}
+
+void PacketCollector::fail(PacketParseError error)
+{
+    error_counts[static_cast<size_t>(error)]++;
+
+    reset();
+}
+
+uint32_t PacketCollector::get_error_count(PacketParseError error) const
+{
+    if (error >= PacketParseError::count) {
+        return 0;
+    }
+
+    return error_counts[static_cast<size_t>(error)];
+}
+
+uint32_t PacketCollector::get_total_error_count() const
+{
+    uint32_t total = 0;
+
+    for (auto count : error_counts) {
+        total += count;
     }
+
+    return total;
 }
+
+uint32_t PacketCollector::get_packet_count() const
+{
+    return packet_count;
+}
+
@@ -2,14 +2,20 @@
 #define PACKET_COLLECTOR_H
 
 #include "packet.hpp"
+#include <array>
 #include <cstdint>
 #include <functional>
-#include <vector>
 #include <zephyr/kernel.h>
 
+/**
+ * Reassembles packets from a stream of notification bytes
+ *
+ * Bytes are unescaped, checksummed and split into header and data as they arrive so each byte costs O(1)
+ * work and nothing is allocated. Bytes before a SOP are dropped.
+ */
 class PacketCollector {
 public:
-    using PacketCollectorCallbackType = std::function<void(Packet packet)>;
+    using PacketCollectorCallbackType = std::function<void(const PacketView& packet)>;
 
     PacketCollector(PacketCollectorCallbackType cb);
 
@@ -18,14 +24,81 @@ public:
      *
      * @param data The data to add
      * @param len The length of the data
+     *
+     * @note The callback is called with a view into the collector's buffer for every complete packet
      */
     void add_packet(const uint8_t* data, uint16_t len);
 
+    /**
+     * @brief Get how many packets have been rejected for a reason
+     *
+     * @param error The reason
+     */
+    uint32_t get_error_count(PacketParseError error) const;
+
+    /**
+     * @brief Get how many packets have been rejected for any reason
+     */
+    uint32_t get_total_error_count() const;
+
+    /**
+     * @brief Get how many packets have been passed to the callback
+     */
+    uint32_t get_packet_count() const;
+
 private:
-    std::vector<uint8_t> received_data;
+    enum class State : uint8_t {
+        WAIT_START,
+        BODY,
+        ESCAPE,
+    };
+
+    /**
+     * @brief Feed a single byte into the state machine
+     */
+    void add_byte(uint8_t byte);
+
+    /**
+     * @brief Append an unescaped byte to the packet being collected
+     */
+    void push(uint8_t byte);
+
+    /**
+     * @brief Validate the collected packet and pass it to the callback
+     */
+    void finish();
+
+    /**
+     * @brief Drop the packet being collected and wait for the next SOP
+     */
+    void reset();
+
+    /**
+     * @brief Record why the packet being collected was rejected and drop it
+     */
+    void fail(PacketParseError error);
+
+    State state = State::WAIT_START;
+
+    /** @brief Unescaped bytes of the packet being collected (flags through checksum) */
+    std::array<uint8_t, PACKET_MAX_SIZE> buffer;
+
+    /** @brief Number of bytes in the buffer */
+    size_t length = 0;
+
+    /** @brief Length of the header (flags through err), known once the flags have arrived */
+    size_t header_length = 0;
+
+    /** @brief Running sum of the bytes in the buffer */
+    uint8_t sum = 0;
+
+    /** @brief Number of packets rejected for each PacketParseError */
+    std::array<uint32_t, static_cast<size_t>(PacketParseError::count)> error_counts = {};
+
+    /** @brief Number of packets passed to the callback */
+    uint32_t packet_count = 0;
+
     PacketCollectorCallbackType callback;
-    struct k_mutex mutex; // Mutex for synchronization
-    int count = 0;
 };
 
-#endif // PACKET_COLLECTOR_H
\ No newline at end of file
+#endif // PACKET_COLLECTOR_H
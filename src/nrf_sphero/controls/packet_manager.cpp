@@ -5,7 +5,8 @@
 
 LOG_MODULE_REGISTER(PacketManager, LOG_LEVEL_DBG);
 
-PacketManager::PacketManager()
+PacketManager::PacketManager(ResponseTable* response_table)
+    : response_table(response_table)
 {
     seq = 0;
 }
@@ -20,6 +21,11 @@ Packet PacketManager::new_packet(uint8_t did, uint8_t cid, uint8_t tid, std::vec
         sid = 0x1;
     }
 
+    // Every slot in use holds a credit of the in-flight window, which is smaller than the table, so one is free
+    for (int i = 0; response_table && i < RESPONSE_TABLE_SIZE && response_table->in_use(seq); i++) {
+        seq = (seq + 1) % 0xff;
+    }
+
     Packet packet(flags, did, cid, seq, tid, sid, PacketError::success, data);
 
     seq = (seq + 1) % 0xff;
@@ -2,18 +2,25 @@
 #define PACKET_MANAGER_H
 
 #include "packet.hpp"
+#include "response_table.hpp"
 #include <vector>
 
 class PacketManager {
 private:
     uint8_t seq;
 
+    /** @brief Table the packets' responses are registered in, may be nullptr */
+    ResponseTable* response_table;
+
 public:
-    PacketManager();
+    PacketManager(ResponseTable* response_table = nullptr);
 
     /**
      * @brief Create a new packet
      *
+     * The packet requests a full response, see Packet::set_response_policy to ask for less. Sequence numbers whose
+     * response slot is still in use are skipped
+     *
      * @returns Packet The newly created packet
      */
     Packet new_packet(uint8_t did, uint8_t cid, uint8_t tid = 0, std::vector<unsigned char> data = {});
@@ -0,0 +1,276 @@
+#include "response_table.hpp"
+#include "packet.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(ResponseTable, LOG_LEVEL_DBG);
+
+ResponseTable::ResponseTable(uint8_t window)
+{
+    window_size = window;
+
+    k_sem_init(&credits, window, window);
+
+    for (auto& slot : slots) {
+        atomic_set(&slot.state, FREE);
+        slot.id = 0;
+        slot.timestamp = 0;
+        slot.timeout_ms = 0;
+        slot.awaited = false;
+        slot.callback = nullptr;
+        slot.context = nullptr;
+        slot.len = 0;
+        k_poll_signal_init(&slot.signal);
+    }
+}
+
+ResponseTable::Slot& ResponseTable::slot_of(uint8_t seq)
+{
+    return slots[seq & (RESPONSE_TABLE_SIZE - 1)];
+}
+
+bool ResponseTable::free_slot(Slot& slot, atomic_val_t from)
+{
+    if (!atomic_cas(&slot.state, from, FREE)) {
+        return false;
+    }
+
+    k_sem_give(&credits);
+
+    return true;
+}
+
+bool ResponseTable::reclaim(Slot& slot, uint32_t now)
+{
+    // Callback slots expire through expire_callbacks so their callback is called
+    if (now - slot.timestamp <= slot.timeout_ms || slot.callback) {
+        return false;
+    }
+
+    // Only slots nobody is writing to can be reclaimed
+    return free_slot(slot, WAITING) || free_slot(slot, COMPLETE);
+}
+
+CommandResponse ResponseTable::register_response(const Packet& packet, bool awaited, uint32_t timeout_ms, k_timeout_t credit_timeout)
+{
+    return register_slot(packet, awaited, timeout_ms, credit_timeout, nullptr, nullptr);
+}
+
+CommandResponse ResponseTable::register_callback(const Packet& packet, uint32_t timeout_ms, ResponseCallback callback, void* context)
+{
+    return register_slot(packet, false, timeout_ms, K_NO_WAIT, callback, context);
+}
+
+CommandResponse ResponseTable::register_slot(const Packet& packet, bool awaited, uint32_t timeout_ms, k_timeout_t credit_timeout, ResponseCallback callback, void* context)
+{
+    CommandResponse response = { packet.id(), packet.seq, false };
+    Slot& slot = slot_of(packet.seq);
+
+    if (k_sem_take(&credits, K_NO_WAIT) != 0) {
+        // Responses may have been lost, so take back any credits which have expired before waiting
+        reclaim_stale();
+
+        if (k_sem_take(&credits, credit_timeout) != 0) {
+            return response;
+        }
+    }
+
+    if (!atomic_cas(&slot.state, FREE, CLAIMED)) {
+        if (!reclaim(slot, k_uptime_get_32()) || !atomic_cas(&slot.state, FREE, CLAIMED)) {
+            // Taken by an earlier seq which hasn't been answered yet
+            LOG_WRN("Response slot of seq %d still in use", packet.seq);
+            k_sem_give(&credits);
+            return response;
+        }
+
+        LOG_WRN("Reclaimed stale response slot of seq %d", packet.seq);
+    }
+
+    slot.id = response.id;
+    slot.timestamp = k_uptime_get_32();
+    slot.timeout_ms = timeout_ms;
+    slot.awaited = awaited;
+    slot.callback = callback;
+    slot.context = context;
+    slot.len = 0;
+    k_poll_signal_reset(&slot.signal);
+
+    if (callback) {
+        atomic_inc(&callbacks);
+    }
+
+    // Publish the slot to the RX thread
+    atomic_set(&slot.state, WAITING);
+
+    response.registered = true;
+
+    return response;
+}
+
+bool ResponseTable::complete(const PacketView& packet)
+{
+    Slot& slot = slot_of(packet.seq);
+
+    if (!atomic_cas(&slot.state, WAITING, FILLING)) {
+        return false;
+    }
+
+    if (slot.id != packet.id()) {
+        atomic_set(&slot.state, WAITING);
+        return false;
+    }
+
+    rtt_estimator.add_sample(k_uptime_get_32() - slot.timestamp);
+
+    if (slot.callback) {
+        ResponseCallback callback = slot.callback;
+        void* context = slot.context;
+
+        // Free first so the callback can send the next command
+        slot.callback = nullptr;
+        free_slot(slot, FILLING);
+        atomic_dec(&callbacks);
+
+        callback(&packet, 0, context);
+        return true;
+    }
+
+    if (!slot.awaited) {
+        free_slot(slot, FILLING);
+        return true;
+    }
+
+    slot.flags = packet.flags;
+    slot.err = packet.err;
+    slot.len = std::min(packet.len, static_cast<size_t>(RESPONSE_DATA_SIZE));
+    memcpy(slot.data, packet.data, slot.len);
+
+    atomic_set(&slot.state, COMPLETE);
+
+    k_poll_signal_raise(&slot.signal, packet.seq);
+
+    return true;
+}
+
+struct k_poll_signal* ResponseTable::signal(const CommandResponse& response)
+{
+    return &slot_of(response.seq).signal;
+}
+
+std::optional<Packet> ResponseTable::take(const CommandResponse& response)
+{
+    Slot& slot = slot_of(response.seq);
+
+    if (atomic_get(&slot.state) != COMPLETE || slot.id != response.id) {
+        return std::nullopt;
+    }
+
+    uint8_t did = (slot.id >> 16) & 0xff;
+    uint8_t cid = (slot.id >> 8) & 0xff;
+
+    Packet packet(slot.flags, did, cid, response.seq, 0, 0, slot.err, std::vector<unsigned char>(slot.data, slot.data + slot.len));
+
+    free_slot(slot, COMPLETE);
+
+    return packet;
+}
+
+void ResponseTable::release(const CommandResponse& response)
+{
+    Slot& slot = slot_of(response.seq);
+
+    if (!response.registered || slot.id != response.id) {
+        return;
+    }
+
+    for (;;) {
+        if (slot.callback && atomic_cas(&slot.state, WAITING, FILLING)) {
+            // The callback won't be called. Cleared before the slot is free so a new registration isn't affected
+            slot.callback = nullptr;
+            free_slot(slot, FILLING);
+            atomic_dec(&callbacks);
+            return;
+        }
+
+        if (free_slot(slot, WAITING) || free_slot(slot, COMPLETE)) {
+            return;
+        }
+
+        if (atomic_get(&slot.state) != FILLING) {
+            return;
+        }
+
+        // The RX thread is copying the response in, which only takes a moment
+        k_yield();
+    }
+}
+
+size_t ResponseTable::reclaim_stale()
+{
+    uint32_t now = k_uptime_get_32();
+    size_t reclaimed = 0;
+
+    for (auto& slot : slots) {
+        if (reclaim(slot, now)) {
+            reclaimed++;
+        }
+    }
+
+    return reclaimed;
+}
+
+size_t ResponseTable::expire_callbacks()
+{
+    uint32_t now = k_uptime_get_32();
+
+    if (atomic_get(&callbacks) == 0) {
+        return 0;
+    }
+
+    for (auto& slot : slots) {
+        // Only a hint, the slot may be reused until it's ours
+        if (!slot.callback || now - slot.timestamp <= slot.timeout_ms || !atomic_cas(&slot.state, WAITING, FILLING)) {
+            continue;
+        }
+
+        ResponseCallback callback = slot.callback;
+        void* context = slot.context;
+
+        if (!callback || now - slot.timestamp <= slot.timeout_ms) {
+            // Reused by a newer registration in the meantime
+            atomic_set(&slot.state, WAITING);
+            continue;
+        }
+
+        slot.callback = nullptr;
+        free_slot(slot, FILLING);
+        atomic_dec(&callbacks);
+
+        callback(nullptr, -ETIMEDOUT, context);
+    }
+
+    return atomic_get(&callbacks);
+}
+
+bool ResponseTable::in_use(uint8_t seq)
+{
+    return atomic_get(&slot_of(seq).state) != FREE;
+}
+
+size_t ResponseTable::in_flight()
+{
+    return window_size - k_sem_count_get(&credits);
+}
+
+size_t ResponseTable::window() const
+{
+    return window_size;
+}
+
+const RttEstimator& ResponseTable::rtt() const
+{
+    return rtt_estimator;
+}
@@ -0,0 +1,235 @@
+#ifndef RESPONSE_TABLE_H
+#define RESPONSE_TABLE_H
+
+#include "packet.hpp"
+#include "rtt_estimator.hpp"
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <zephyr/kernel.h>
+
+/**
+ * Number of slots in the table, a power of two. A packet's slot is its seq modulo the size
+ *
+ * @note Only needs to cover the commands in flight (see SPHERO_INFLIGHT_WINDOW). PacketManager skips sequence numbers
+ *       whose slot is still in use, so registering never fails because two sequence numbers share a slot
+ */
+#ifndef RESPONSE_TABLE_SIZE
+#define RESPONSE_TABLE_SIZE 32
+#endif
+
+static_assert((RESPONSE_TABLE_SIZE & (RESPONSE_TABLE_SIZE - 1)) == 0, "RESPONSE_TABLE_SIZE must be a power of two");
+
+/**
+ * Bytes of response data kept per slot. Longer responses are truncated
+ *
+ * @note The responses we wait on (wake, drive, frame uploads) carry no data so this is kept small
+ */
+#define RESPONSE_DATA_SIZE 8
+
+/**
+ * Default time after which an unanswered slot that is being waited on may be reclaimed
+ *
+ * @note Waits are bounded by the round trip estimate, see ResponseTable::rtt
+ */
+#define RESPONSE_TIMEOUT_MS 10000
+
+/**
+ * @brief Handle to a response that is being waited on
+ */
+struct CommandResponse {
+    /** @brief Id (did, cid, seq) of the command */
+    uint32_t id;
+    /** @brief Sequence number, which picks the slot */
+    uint8_t seq;
+    /** @brief Whether a slot was registered for the response */
+    bool registered;
+};
+
+/**
+ * @brief Called when the response to a command registered with ResponseTable::register_callback arrives or times out
+ *
+ * @param packet The response, nullptr unless err is 0. Only valid for the duration of the call
+ * @param err 0 if the response arrived, -ETIMEDOUT if it didn't within the timeout
+ * @param context Context given to register_callback
+ */
+typedef void (*ResponseCallback)(const PacketView* packet, int err, void* context);
+
+/**
+ * Fixed size table of commands whose responses haven't arrived yet, indexed by sequence number modulo
+ * RESPONSE_TABLE_SIZE
+ *
+ * Registering and completing are O(1), lock-free and never allocate. The owner registers a slot before sending a
+ * command and the packet processing thread completes it when the response arrives. Slots which are never answered are
+ * reclaimed once their timeout has expired.
+ *
+ * Every slot in use holds one credit of the in-flight window, so at most window commands can be waiting for a
+ * response at once. Credits come back as responses arrive.
+ */
+class ResponseTable {
+public:
+    /**
+     * @param window The maximum number of commands in flight, at most RESPONSE_TABLE_SIZE
+     */
+    ResponseTable(uint8_t window);
+
+    /**
+     * @brief Register a slot for the response to a packet
+     *
+     * @param packet The packet that is about to be sent
+     * @param awaited Whether the response will be waited on. If not the slot is freed as soon as the response
+     *                arrives and only serves to hold a credit of the window
+     * @param timeout_ms How long before the slot can be reclaimed
+     * @param credit_timeout How long to wait for a credit if the window is full
+     *
+     * @retval CommandResponse The handle to wait on. registered is false if the window is full or the slot is still
+     *                         in use
+     */
+    CommandResponse register_response(const Packet& packet, bool awaited, uint32_t timeout_ms, k_timeout_t credit_timeout = K_NO_WAIT);
+
+    /**
+     * @brief Register a slot whose response is handed to a callback instead of being waited on
+     *
+     * The callback is called exactly once, by complete when the response arrives or by expire_callbacks once
+     * timeout_ms has passed, unless the response is released first. Both run on the thread that parses packets
+     *
+     * @param packet The packet that is about to be sent
+     * @param timeout_ms How long to wait for the response
+     * @param callback Called with the response or the timeout
+     * @param context Passed to the callback
+     *
+     * @retval CommandResponse The handle of the slot. registered is false if the window is full or the slot is
+     *                         still in use
+     */
+    CommandResponse register_callback(const Packet& packet, uint32_t timeout_ms, ResponseCallback callback, void* context);
+
+    /**
+     * @brief Store a received packet in its slot and raise the slot's signal, or pass it to the slot's callback
+     *
+     * @param packet The received packet
+     *
+     * @retval true If something was waiting for the packet
+     */
+    bool complete(const PacketView& packet);
+
+    /**
+     * @brief Get the signal raised when the response arrives
+     */
+    struct k_poll_signal* signal(const CommandResponse& response);
+
+    /**
+     * @brief Take the response out of its slot, freeing the slot
+     *
+     * @retval std::optional<Packet> The packet if the response has arrived
+     */
+    std::optional<Packet> take(const CommandResponse& response);
+
+    /**
+     * @brief Stop waiting for a response, freeing the slot
+     */
+    void release(const CommandResponse& response);
+
+    /**
+     * @brief Free every slot whose timeout has expired
+     *
+     * @retval The number of slots reclaimed
+     */
+    size_t reclaim_stale();
+
+    /**
+     * @brief Free every callback slot whose timeout has expired and call its callback with -ETIMEDOUT
+     *
+     * @note reclaim_stale leaves callback slots alone so callbacks are only called from one thread
+     *
+     * @retval The number of callback slots still waiting
+     */
+    size_t expire_callbacks();
+
+    /**
+     * @brief Get the number of commands waiting for a response
+     */
+    size_t in_flight();
+
+    /**
+     * @brief Whether the slot of a sequence number is taken, so a packet with it couldn't be registered
+     */
+    bool in_use(uint8_t seq);
+
+    /**
+     * @brief Get the maximum number of commands that can wait for a response
+     */
+    size_t window() const;
+
+    /**
+     * @brief Get the round trip estimate, updated with every response matched to its slot
+     */
+    const RttEstimator& rtt() const;
+
+private:
+    enum SlotState : atomic_val_t {
+        /** Nothing is waiting */
+        FREE,
+        /** Being set up by the owner */
+        CLAIMED,
+        /** Waiting for the response */
+        WAITING,
+        /** Response being copied in by the RX thread */
+        FILLING,
+        /** Response has arrived */
+        COMPLETE,
+    };
+
+    struct Slot {
+        atomic_t state;
+        uint32_t id;
+        /** @brief Uptime in ms when the slot was registered */
+        uint32_t timestamp;
+        /** @brief Time in ms after which the slot can be reclaimed */
+        uint32_t timeout_ms;
+        /** @brief Whether the response is waited on, otherwise the slot only holds a credit */
+        bool awaited;
+        /** @brief Called instead of storing the response, see register_callback */
+        ResponseCallback callback;
+        void* context;
+        struct k_poll_signal signal;
+        PacketFlags flags;
+        PacketError err;
+        uint8_t len;
+        uint8_t data[RESPONSE_DATA_SIZE];
+    };
+
+    /**
+     * @brief Get the slot of a sequence number
+     */
+    Slot& slot_of(uint8_t seq);
+
+    /**
+     * @brief Try to move a slot that has timed out back to FREE
+     */
+    bool reclaim(Slot& slot, uint32_t now);
+
+    /**
+     * @brief Claim the slot of a packet, set it up and publish it to the RX thread
+     */
+    CommandResponse register_slot(const Packet& packet, bool awaited, uint32_t timeout_ms, k_timeout_t credit_timeout, ResponseCallback callback, void* context);
+
+    /**
+     * @brief Move a slot from a state back to FREE, returning its credit
+     */
+    bool free_slot(Slot& slot, atomic_val_t from);
+
+    std::array<Slot, RESPONSE_TABLE_SIZE> slots;
+
+    /** @brief Number of callback slots waiting */
+    atomic_t callbacks = ATOMIC_INIT(0);
+
+    /** @brief Round trip of the responses, measured from registration */
+    RttEstimator rtt_estimator;
+
+    /** @brief Credits of the in-flight window */
+    struct k_sem credits;
+
+    uint8_t window_size;
+};
+
+#endif // RESPONSE_TABLE_H
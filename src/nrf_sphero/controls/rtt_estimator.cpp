@@ -0,0 +1,64 @@
+#include "rtt_estimator.hpp"
+#include <algorithm>
+#include <cstdlib>
+
+RttEstimator::RttEstimator(uint32_t min_timeout_ms, uint32_t max_timeout_ms)
+    : min_timeout(min_timeout_ms)
+    , max_timeout(max_timeout_ms)
+{
+}
+
+void RttEstimator::add_sample(uint32_t rtt_ms)
+{
+    int32_t rtt = static_cast<int32_t>(std::min(rtt_ms, max_timeout));
+
+    if (atomic_get(&samples) == 0) {
+        atomic_set(&srtt_x8, rtt << 3);
+        atomic_set(&rttvar_x4, rtt << 1);
+    } else {
+        int32_t srtt_x8_value = atomic_get(&srtt_x8);
+        int32_t rttvar_x4_value = atomic_get(&rttvar_x4);
+
+        // srtt += (rtt - srtt) / 8, rttvar += (|rtt - srtt| - rttvar) / 4
+        int32_t err = rtt - (srtt_x8_value >> 3);
+
+        atomic_set(&srtt_x8, srtt_x8_value + err);
+        atomic_set(&rttvar_x4, rttvar_x4_value + std::abs(err) - (rttvar_x4_value >> 2));
+    }
+
+    atomic_inc(&samples);
+}
+
+uint32_t RttEstimator::timeout_ms() const
+{
+    if (atomic_get(&samples) == 0) {
+        return std::clamp<uint32_t>(RTT_INITIAL_TIMEOUT_MS, min_timeout, max_timeout);
+    }
+
+    // srtt + 4 * rttvar, with at least a millisecond for the variance since that's the clock's granularity
+    uint32_t timeout = srtt_ms() + std::max<uint32_t>(atomic_get(&rttvar_x4), 1);
+
+    return std::clamp(timeout, min_timeout, max_timeout);
+}
+
+uint32_t RttEstimator::backoff_timeout_ms(uint8_t attempt) const
+{
+    uint64_t timeout = static_cast<uint64_t>(timeout_ms()) << std::min<uint8_t>(attempt, 16);
+
+    return static_cast<uint32_t>(std::min<uint64_t>(timeout, max_timeout));
+}
+
+uint32_t RttEstimator::srtt_ms() const
+{
+    return atomic_get(&srtt_x8) >> 3;
+}
+
+uint32_t RttEstimator::rttvar_ms() const
+{
+    return atomic_get(&rttvar_x4) >> 2;
+}
+
+uint32_t RttEstimator::sample_count() const
+{
+    return atomic_get(&samples);
+}
@@ -0,0 +1,91 @@
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+#include <cstdint>
+#include <zephyr/kernel.h>
+
+/**
+ * Shortest response timeout the estimator will give
+ */
+#ifndef RTT_MIN_TIMEOUT_MS
+#define RTT_MIN_TIMEOUT_MS 100
+#endif
+
+/**
+ * Longest response timeout the estimator will give, also the limit for backed off timeouts
+ */
+#ifndef RTT_MAX_TIMEOUT_MS
+#define RTT_MAX_TIMEOUT_MS 10000
+#endif
+
+/**
+ * Response timeout until the first round trip has been measured
+ */
+#ifndef RTT_INITIAL_TIMEOUT_MS
+#define RTT_INITIAL_TIMEOUT_MS 1000
+#endif
+
+/**
+ * Smoothed round trip time and variance of a Sphero's responses, as TCP estimates them (RFC 6298)
+ *
+ * The timeout is the smoothed RTT plus four times the variance, clamped to [min, max]. Values are kept in fixed
+ * point (RTT x8, variance x4) so updating only takes shifts.
+ *
+ * @note Samples are added by one thread (the packet processing work queue) while any thread may read the estimate
+ */
+class RttEstimator {
+public:
+    /**
+     * @param min_timeout_ms Shortest timeout to give
+     * @param max_timeout_ms Longest timeout to give
+     */
+    RttEstimator(uint32_t min_timeout_ms = RTT_MIN_TIMEOUT_MS, uint32_t max_timeout_ms = RTT_MAX_TIMEOUT_MS);
+
+    /**
+     * @brief Add a measured round trip
+     *
+     * @param rtt_ms Time from registering a command to its response arriving
+     */
+    void add_sample(uint32_t rtt_ms);
+
+    /**
+     * @brief Get how long to wait for a response
+     */
+    uint32_t timeout_ms() const;
+
+    /**
+     * @brief Get the timeout for a retry, doubled for every previous attempt
+     *
+     * @param attempt The number of attempts that have already timed out
+     */
+    uint32_t backoff_timeout_ms(uint8_t attempt) const;
+
+    /**
+     * @brief Get the smoothed round trip time, 0 until the first sample
+     */
+    uint32_t srtt_ms() const;
+
+    /**
+     * @brief Get the round trip time variance, 0 until the first sample
+     */
+    uint32_t rttvar_ms() const;
+
+    /**
+     * @brief Get the number of round trips measured
+     */
+    uint32_t sample_count() const;
+
+private:
+    /** @brief Smoothed RTT x8 */
+    atomic_t srtt_x8 = ATOMIC_INIT(0);
+
+    /** @brief RTT variance x4 */
+    atomic_t rttvar_x4 = ATOMIC_INIT(0);
+
+    atomic_t samples = ATOMIC_INIT(0);
+
+    uint32_t min_timeout;
+    uint32_t max_timeout;
+};
+
+#endif // RTT_ESTIMATOR_H
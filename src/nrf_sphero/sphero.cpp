@@ -5,7 +5,6 @@
 #include "controls/processors.hpp"
 #include "utils/color.hpp"
 #include <functional>
-#include <future>
 #include <memory>
 #include <optional>
 #include <unordered_map>
@@ -23,202 +22,691 @@ LOG_MODULE_REGISTER(Sphero, LOG_LEVEL_DBG);
 #include <iomanip>
 #include <sstream>
 
-uint8_t Sphero::received_cb_wrapper(struct bt_sphero_client* sphero, const uint8_t* data, uint16_t len, void* context)
+K_THREAD_STACK_DEFINE(packet_wq_stack, PACKET_PROCESSING_STACK_SIZE);
+static struct k_work_q packet_wq;
+
+/**
+ * @brief Start the work queue which parses notifications, shared by every Sphero
+ */
+static void packet_queue_start()
 {
+    static bool started = false;
+
+    if (started) {
+        return;
+    }
+
+    started = true;
+
+    struct k_work_queue_config cfg = {};
+    cfg.name = "sphero_packets";
+
+    k_work_queue_init(&packet_wq);
+    k_work_queue_start(&packet_wq, packet_wq_stack, K_THREAD_STACK_SIZEOF(packet_wq_stack), PACKET_PROCESSING_QUEUE_PRIORITY, &cfg);
+}
 
+uint8_t Sphero::received_cb_wrapper(struct bt_sphero_client* sphero, const uint8_t* data, uint16_t len, void* context)
+{
     Sphero* sphero_instance = static_cast<Sphero*>(context);
 
-    sphero_instance->packet_collector->add_packet(data, len);
+    if (data == nullptr) {
+        // Unsubscribed
+        return BT_GATT_ITER_CONTINUE;
+    }
+
+    // A partial notification would only corrupt the packet stream, so drop all of it
+    if (ring_buf_space_get(&sphero_instance->rx_ring) < len) {
+        atomic_inc(&sphero_instance->rx_overflows);
+        LOG_WRN("Sphero %d: RX ring full, dropping %d bytes", sphero_instance->sphero_id, len);
+    } else {
+        ring_buf_put(&sphero_instance->rx_ring, data, len);
+    }
 
-    return 1;
+    k_work_submit_to_queue(&packet_wq, &sphero_instance->rx_work.work);
+
+    return BT_GATT_ITER_CONTINUE;
 }
 
-void Sphero::handle_packet(Packet packet)
+void Sphero::rx_work_handler(struct k_work* work)
 {
-    auto id = packet.id();
+    RxWork* rx_work = CONTAINER_OF(work, RxWork, work);
+    Sphero* sphero = rx_work->sphero;
+    uint8_t* data;
+    uint32_t len;
+
+    // Parse straight out of the ring, at most twice per wrap
+    while ((len = ring_buf_get_claim(&sphero->rx_ring, &data, SPHERO_RX_RING_SIZE)) > 0) {
+        sphero->packet_collector->add_packet(data, len);
+        ring_buf_get_finish(&sphero->rx_ring, len);
+    }
+}
 
-    if (waiting.find(id) == waiting.end()) {
-        // NOTE: We don't want to log this since it will happen a lot
-        // NOTE: There are packets which we should handle related to disconnecting
-        // LOG_ERR("No signal found for packet id %d", id);
+void Sphero::handle_packet(const PacketView& packet)
+{
+    // NOTE: Most packets won't have anything waiting on them so we don't log when nothing is found
+    // NOTE: There are packets which we should handle related to disconnecting
+    if (response_table.complete(packet)) {
         return;
     }
 
-    auto signal = waiting[id];
+    // Commands sent with ResponsePolicy::errors_only only come back when they fail
+    if (packet.err != PacketError::success) {
+        LOG_WRN("Sphero %d: command 0x%02x/0x%02x (seq %d) failed with error %d", sphero_id, packet.did, packet.cid,
+            packet.seq, static_cast<uint8_t>(packet.err));
+    }
+}
+
+void Sphero::subscribe()
+{
+    // The scanner subscribes now if connected and again after every reconnect
+    scanner_bind_sphero(sphero_id, &received_cb_wrapper, &connected_cb_wrapper, this);
+}
+
+void Sphero::connected_cb_wrapper(uint8_t id, void* context)
+{
+    Sphero* sphero_instance = static_cast<Sphero*>(context);
 
-    responses.insert_or_assign(id, packet);
+    // Needs waking again before it counts as ready
+    atomic_clear(&sphero_instance->ready);
 
-    k_poll_signal_raise(signal.get(), id);
+    k_work_submit(&sphero_instance->replay_work.work);
 }
 
-void Sphero::subscribe()
+void Sphero::replay_work_handler(struct k_work* work)
 {
-    bt_sphero_client* sphero_client = scanner_get_sphero(sphero_id);
+    ReplayWork* replay_work = CONTAINER_OF(work, ReplayWork, work);
 
-    if (sphero_client == nullptr) {
-        LOG_ERR("Sphero not found");
-        return;
+    replay_work->sphero->replay_state();
+}
+
+void Sphero::replay_state()
+{
+    LOG_INF("Sphero %d connected, replaying state", sphero_id);
+
+    int err = execute_async(Power::wake(*this), replay_woken, this);
+
+    if (err) {
+        LOG_WRN("Sphero %d: failed to wake after reconnecting (err %d)", sphero_id, err);
+    }
+
+    // Copy first since the setters below record state too
+    k_mutex_lock(&state_lock, K_FOREVER);
+    State last = state;
+    k_mutex_unlock(&state_lock);
+
+    if (last.locator_flags) {
+        set_locator_flags(*last.locator_flags);
+    }
+
+    if (last.matrix_color) {
+        set_matrix_color(*last.matrix_color);
+    }
+
+    if (last.led_mask) {
+        std::vector<uint8_t> led_values;
+
+        for (int i = 0; i < 8; i++) {
+            if (last.led_mask & (1 << i)) {
+                led_values.push_back(last.led_values[i]);
+            }
+        }
+
+        set_all_leds_with_8_bit_mask(last.led_mask, led_values);
     }
 
-    int err = bt_sphero_subscribe(sphero_client, &received_cb_wrapper, this);
+    if (last.heading) {
+        set_heading(*last.heading);
+    }
+}
+
+void Sphero::replay_woken(const PacketView* packet, int err, void* context)
+{
+    Sphero* sphero = static_cast<Sphero*>(context);
+
     if (err) {
-        LOG_ERR("Failed to subscribe to notifications (err %d)", err);
+        LOG_WRN("Sphero %d didn't answer the wake after reconnecting (err %d)", sphero->sphero_id, err);
+        return;
     }
 
-    scanner_release_sphero(sphero_client);
+    atomic_set(&sphero->ready, 1);
+}
+
+void Sphero::sweep_work_handler(struct k_work* work)
+{
+    struct k_work_delayable* dwork = k_work_delayable_from_work(work);
+    SweepWork* sweep_work = CONTAINER_OF(dwork, SweepWork, work);
+
+    if (sweep_work->sphero->response_table.expire_callbacks() > 0) {
+        k_work_reschedule_for_queue(&packet_wq, dwork, K_MSEC(SPHERO_RESPONSE_SWEEP_MS));
+    }
 }
 
 Sphero::Sphero(uint8_t id)
+    : response_table(SPHERO_INFLIGHT_WINDOW)
 {
     sphero_id = id;
+    slot = scanner_get_slot(id);
     frame_index = 0;
     animation_index = 0;
 
-    packet_manager = new PacketManager();
+    k_mutex_init(&state_lock);
 
-    packet_collector = new PacketCollector(std::bind(&Sphero::handle_packet, this, std::placeholders::_1));
+    replay_work.sphero = this;
+    k_work_init(&replay_work.work, replay_work_handler);
 
-    subscribe();
+    ring_buf_init(&rx_ring, sizeof(rx_ring_data), rx_ring_data);
 
-    auto response = wake_with_response();
+    packet_queue_start();
 
-    wait_for_response(response);
+    rx_work.sphero = this;
+    k_work_init(&rx_work.work, rx_work_handler);
 
-    turn_off_all_leds();
+    sweep_work.sphero = this;
+    k_work_init_delayable(&sweep_work.work, sweep_work_handler);
+
+    for (uint8_t i = 0; i < SPHERO_ASYNC_RETRY_COUNT; i++) {
+        retry_works[i].sphero = this;
+        retry_works[i].index = i;
+        atomic_clear(&retry_works[i].busy);
+        k_work_init(&retry_works[i].work, retry_work_handler);
+    }
+
+    packet_manager = new PacketManager(&response_table);
+
+    packet_collector = new PacketCollector(std::bind(&Sphero::handle_packet, this, std::placeholders::_1));
+
+    // Waking is left to the caller so every Sphero can be woken at once, see Swarm::wake
+    subscribe();
 };
 
 Sphero::~Sphero()
 {
+    scanner_bind_sphero(sphero_id, nullptr, nullptr, nullptr);
+
+    struct k_work_sync sync;
+
+    // Responses and expired sweeps are what schedule resends, so they're stopped first
+    k_work_cancel_sync(&rx_work.work, &sync);
+    k_work_cancel_delayable_sync(&sweep_work.work, &sync);
+    k_work_cancel_sync(&replay_work.work, &sync);
+
+    for (uint8_t i = 0; i < SPHERO_ASYNC_RETRY_COUNT; i++) {
+        k_work_cancel_sync(&retry_works[i].work, &sync);
+        retry_packets[i] = nullptr;
+    }
+
+    // A resend which was running may have scheduled another sweep
+    k_work_cancel_delayable_sync(&sweep_work.work, &sync);
+
+    delete packet_collector;
     delete packet_manager;
 };
 
-void Sphero::execute(const Packet& packet, bool test)
+int Sphero::execute(const Packet& packet, bt_sphero_write_mode mode, bool test)
+{
+    CommandResponse response = {};
+
+    if (packet.response_policy() == ResponsePolicy::full && !test) {
+        response = response_table.register_response(packet, false, get_response_timeout_ms());
+
+        if (!response.registered) {
+            LOG_WRN("Too many commands in flight");
+            return -EBUSY;
+        }
+    }
+
+    int err = transmit(packet, mode, test);
+
+    if (err) {
+        response_table.release(response);
+    }
+
+    return err;
+}
+
+CommandResponse Sphero::execute_with_response(const Packet& packet)
+{
+    if (packet.response_policy() != ResponsePolicy::full) {
+        LOG_ERR("Packet doesn't request a response to wait for");
+        return {};
+    }
+
+    auto response = response_table.register_response(packet, true, RESPONSE_TIMEOUT_MS);
+
+    if (!response.registered) {
+        LOG_WRN("Too many commands in flight");
+        return response;
+    }
+
+    int err = transmit(packet, BT_SPHERO_WRITE_WITH_RSP, false);
+
+    if (err) {
+        response_table.release(response);
+        response.registered = false;
+    }
+
+    return response;
+}
+
+int Sphero::execute_async(const Packet& packet, ResponseCallback callback, void* context, uint32_t timeout_ms)
+{
+    if (packet.response_policy() != ResponsePolicy::full) {
+        LOG_ERR("Packet doesn't request a response to wait for");
+        return -EINVAL;
+    }
+
+    if (timeout_ms == 0) {
+        timeout_ms = get_response_timeout_ms();
+    }
+
+    auto response = response_table.register_callback(packet, timeout_ms, callback, context);
+
+    if (!response.registered) {
+        LOG_WRN("Too many commands in flight");
+        return -EBUSY;
+    }
+
+    int err = transmit(packet, BT_SPHERO_WRITE_WITH_RSP, false);
+
+    if (err) {
+        response_table.release(response);
+        return err;
+    }
+
+    // Doesn't move a sweep which is already scheduled
+    k_work_schedule_for_queue(&packet_wq, &sweep_work.work, K_MSEC(SPHERO_RESPONSE_SWEEP_MS));
+
+    return 0;
+}
+
+int Sphero::execute_with_retries(const std::function<Packet()>& make_packet, RetryCallback callback, void* context, uint8_t max_retries)
+{
+    RetryWork* retry = nullptr;
+
+    for (auto& candidate : retry_works) {
+        if (atomic_cas(&candidate.busy, 0, 1)) {
+            retry = &candidate;
+            break;
+        }
+    }
+
+    if (retry == nullptr) {
+        LOG_WRN("Too many commands retrying");
+        return -EBUSY;
+    }
+
+    retry_packets[retry->index] = make_packet;
+    retry->callback = callback;
+    retry->context = context;
+    retry->attempt = 0;
+    retry->max_retries = max_retries;
+
+    int err = retry_send(retry);
+
+    if (err) {
+        retry_packets[retry->index] = nullptr;
+        atomic_clear(&retry->busy);
+    }
+
+    return err;
+}
+
+int Sphero::retry_send(RetryWork* retry)
+{
+    return execute_async(retry_packets[retry->index](), retry_response, retry, response_table.rtt().backoff_timeout_ms(retry->attempt));
+}
+
+void Sphero::retry_finish(RetryWork* retry, const PacketView* packet, int err)
+{
+    RetryCallback callback = retry->callback;
+    void* context = retry->context;
+    uint8_t retries = retry->attempt;
+
+    retry->sphero->retry_packets[retry->index] = nullptr;
+    atomic_clear(&retry->busy);
+
+    callback(packet, err, retries, context);
+}
+
+void Sphero::retry_response(const PacketView* packet, int err, void* context)
+{
+    RetryWork* retry = static_cast<RetryWork*>(context);
+    Sphero* sphero = retry->sphero;
+
+    if (err == -ETIMEDOUT) {
+        if (retry->attempt < retry->max_retries) {
+            retry->attempt++;
+            atomic_inc(&sphero->retries);
+            LOG_WRN("Sphero %d: no response, resending (retry %d of %d)", sphero->sphero_id, retry->attempt, retry->max_retries);
+
+            k_work_submit(&retry->work);
+            return;
+        }
+
+        atomic_inc(&sphero->lost_commands);
+        LOG_ERR("Sphero %d: no response after %d retries", sphero->sphero_id, retry->max_retries);
+    }
+
+    retry_finish(retry, packet, err);
+}
+
+void Sphero::retry_work_handler(struct k_work* work)
+{
+    RetryWork* retry = CONTAINER_OF(work, RetryWork, work);
+
+    int err = retry->sphero->retry_send(retry);
+
+    if (err) {
+        LOG_ERR("Sphero %d: failed to resend (err %d)", retry->sphero->sphero_id, err);
+        retry_finish(retry, nullptr, err);
+    }
+}
+
+static_assert(BT_SPHERO_TX_BUF_SIZE >= PACKET_MAX_ENCODED_SIZE, "TX buffers must fit an encoded packet");
+static_assert(SPHERO_INFLIGHT_WINDOW < RESPONSE_TABLE_SIZE, "New packets need a free response slot with every command in flight");
+
+bt_sphero_tx_buf* Sphero::encode_tx_buf(const Packet& packet, bt_sphero_write_mode mode)
+{
+    // Drive and LED commands are superseded by the next one so don't hold up the caller for them
+    k_timeout_t alloc_timeout = mode == BT_SPHERO_WRITE_WITHOUT_RSP ? K_NO_WAIT : K_MSEC(BT_SPHERO_TX_ALLOC_TIMEOUT_MS);
+
+    bt_sphero_tx_buf* buf = bt_sphero_client_tx_alloc(alloc_timeout);
+
+    if (buf == nullptr) {
+        LOG_WRN("No free TX buffers");
+        atomic_inc(&tx_alloc_failures);
+        return nullptr;
+    }
+
+    size_t payload_len = packet.encode(buf->data, sizeof(buf->data));
+
+    if (payload_len == 0) {
+        LOG_ERR("Failed to encode packet");
+        bt_sphero_client_tx_free(buf);
+        return nullptr;
+    }
+
+    buf->len = payload_len;
+    buf->mode = mode;
+
+    return buf;
+}
+
+int Sphero::transmit(const Packet& packet, bt_sphero_write_mode mode, bool test)
 {
+    bt_sphero_tx_buf* buf = encode_tx_buf(packet, mode);
 
-    auto payload = packet.build();
+    if (buf == nullptr) {
+        return -ENOMEM;
+    }
+
+    if (test) {
+        bt_sphero_client_tx_free(buf);
+        return 0;
+    }
 
-    bt_sphero_client* sphero_client = scanner_get_sphero(sphero_id);
+    bt_sphero_client* sphero_client = scanner_slot_acquire(slot);
 
     if (sphero_client == nullptr) {
         LOG_ERR("Sphero not found");
-        return;
+        bt_sphero_client_tx_free(buf);
+        return -ENOTCONN;
     }
 
-    const size_t chunkSize = 20;
-    size_t offset = 0;
+    // The TX queue owns the buffer from here, even on error
+    int err = bt_sphero_client_tx_enqueue(sphero_client, buf);
 
-    while (offset < payload.size()) {
-        size_t remainingBytes = payload.size() - offset;
-        size_t bytesToSend = chunkSize < remainingBytes ? chunkSize : remainingBytes;
+    if (err) {
+        LOG_ERR("Error sending data!");
+    }
 
-        if (!test) {
-            int err = bt_sphero_client_send(sphero_client, payload.data() + offset, bytesToSend);
+    scanner_slot_release(slot);
 
-            if (err) {
-                LOG_ERR("Error sending data!");
-            }
+    return err;
+}
+
+int Sphero::execute_latest(const Packet& packet)
+{
+    CommandResponse response = {};
+
+    if (packet.response_policy() == ResponsePolicy::full) {
+        response = response_table.register_response(packet, false, get_response_timeout_ms());
+
+        if (!response.registered) {
+            LOG_WRN("Too many commands in flight");
+            return -EBUSY;
         }
+    }
 
-        offset += bytesToSend;
+    bt_sphero_tx_buf* buf = encode_tx_buf(packet, BT_SPHERO_WRITE_WITHOUT_RSP);
+
+    if (buf == nullptr) {
+        response_table.release(response);
+        return -ENOMEM;
     }
 
-    scanner_release_sphero(sphero_client);
-};
+    bt_sphero_client* sphero_client = scanner_slot_acquire(slot);
+
+    if (sphero_client == nullptr) {
+        LOG_ERR("Sphero not found");
+        bt_sphero_client_tx_free(buf);
+        response_table.release(response);
+        return -ENOTCONN;
+    }
+
+    // Held across the send so latest_response always belongs to the packet in the slot
+    k_mutex_lock(&state_lock, K_FOREVER);
+
+    int err = bt_sphero_client_tx_send_latest(sphero_client, buf);
+
+    scanner_slot_release(slot);
 
-CommandResponse Sphero::setup_response(const Packet& packet)
+    if (err < 0) {
+        k_mutex_unlock(&state_lock);
+        response_table.release(response);
+        return err;
+    }
+
+    if (err == 1) {
+        // The previous packet will never be sent so neither will its response
+        response_table.release(latest_response);
+    }
+
+    latest_response = response;
+
+    k_mutex_unlock(&state_lock);
+
+    return 0;
+}
+
+size_t Sphero::get_in_flight()
 {
-    std::shared_ptr<struct k_poll_signal> signal = std::make_shared<struct k_poll_signal>();
+    return response_table.in_flight();
+}
 
-    k_poll_signal_init(signal.get());
+uint8_t Sphero::get_id()
+{
+    return sphero_id;
+}
 
-    auto events = std::make_unique<k_poll_event[]>(1);
-    events[0] = K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, signal.get());
+bool Sphero::is_ready()
+{
+    return atomic_get(&ready);
+}
 
-    auto id = packet.id();
+uint32_t Sphero::get_response_timeout_ms()
+{
+    return response_table.rtt().timeout_ms();
+}
+
+Sphero::LinkStats Sphero::get_link_stats()
+{
+    LinkStats stats = {};
+    struct bt_conn* conn = nullptr;
+
+    stats.parse_errors = packet_collector->get_total_error_count();
+    stats.tx_alloc_failures = atomic_get(&tx_alloc_failures);
+    stats.rx_overflows = atomic_get(&rx_overflows);
+    stats.srtt_ms = response_table.rtt().srtt_ms();
+    stats.rttvar_ms = response_table.rtt().rttvar_ms();
+    stats.response_timeout_ms = get_response_timeout_ms();
+    stats.in_flight = get_in_flight();
+    stats.tx_bufs_free = bt_sphero_client_tx_bufs_free();
+    stats.retries = atomic_get(&retries);
+    stats.lost_commands = atomic_get(&lost_commands);
+    stats.stalls = scanner_slot_get_stalls(slot, &stats.stall_disconnects);
+
+    bt_sphero_client* sphero_client = scanner_slot_acquire(slot);
 
-    waiting.insert_or_assign(id, signal);
+    if (sphero_client == nullptr) {
+        return stats;
+    }
+
+    stats.connected = true;
+
+    bt_sphero_client_get_stats(sphero_client, &stats.link);
+
+    if (sphero_client->conn) {
+        conn = bt_conn_ref(sphero_client->conn);
+    }
+
+    scanner_slot_release(slot);
+
+    // Waits on the controller so isn't done while holding the client
+    if (conn) {
+        bt_sphero_conn_read_rssi(conn, &stats.rssi);
+        bt_conn_unref(conn);
+    }
 
-    return events;
+    return stats;
 }
 
-void Sphero::wake()
+int Sphero::finish_wake(const CommandResponse& response)
+{
+    if (!response_table.take(response)) {
+        return -EAGAIN;
+    }
+
+    atomic_set(&ready, 1);
+
+    turn_off_all_leds();
+
+    return 0;
+}
+
+int Sphero::wake()
 {
     auto packet = Power::wake(*this);
 
-    execute(packet);
+    return execute(packet);
 }
 
 CommandResponse Sphero::wake_with_response()
 {
     auto packet = Power::wake(*this);
 
-    execute(packet);
-
-    return setup_response(packet);
+    return execute_with_response(packet);
 }
 
-void Sphero::set_locator_flags(bool locator_flags)
+int Sphero::set_locator_flags(bool locator_flags)
 {
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.locator_flags = locator_flags;
+    k_mutex_unlock(&state_lock);
+
     auto packet = Sensor::set_locator_flags(*this, locator_flags, static_cast<uint8_t>(Processors::SECONDARY));
 
-    execute(packet);
+    return execute(packet);
 }
 
-void Sphero::set_matrix_fill(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, RGBColor color)
+int Sphero::set_matrix_fill(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, RGBColor color)
 {
     auto packet = IO::fill_led_matrix(*this, x1, y1, x2, y2, color, static_cast<uint8_t>(Processors::SECONDARY));
+    packet.set_response_policy(ResponsePolicy::errors_only);
 
-    execute(packet);
+    return execute(packet, BT_SPHERO_WRITE_WITHOUT_RSP);
 }
 
-void Sphero::set_matrix_color(RGBColor color)
+int Sphero::set_matrix_color(RGBColor color)
 {
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.matrix_color = color;
+    k_mutex_unlock(&state_lock);
+
     auto packet = IO::set_led_matrix_color(*this, color, static_cast<uint8_t>(Processors::SECONDARY));
+    packet.set_response_policy(ResponsePolicy::errors_only);
 
-    execute(packet);
+    return execute(packet, BT_SPHERO_WRITE_WITHOUT_RSP);
 }
 
-void Sphero::set_matrix_pixel_color(uint8_t x, uint8_t y, RGBColor color)
+int Sphero::set_matrix_color_with_retries(RGBColor color, RetryCallback callback, void* context, uint8_t max_retries)
+{
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.matrix_color = color;
+    k_mutex_unlock(&state_lock);
+
+    // Full response, unlike set_matrix_color, so a lost command can be noticed
+    return execute_with_retries([this, color]() { return IO::set_led_matrix_color(*this, color, static_cast<uint8_t>(Processors::SECONDARY)); }, callback, context, max_retries);
+}
+
+int Sphero::set_matrix_pixel_color(uint8_t x, uint8_t y, RGBColor color)
 {
     auto packet = IO::set_led_matrix_pixel_color(*this, x, y, color, static_cast<uint8_t>(Processors::SECONDARY));
+    packet.set_response_policy(ResponsePolicy::errors_only);
 
-    execute(packet);
+    return execute(packet, BT_SPHERO_WRITE_WITHOUT_RSP);
 }
 
-void Sphero::set_matrix_character(unsigned char str, RGBColor color)
+int Sphero::set_matrix_character(unsigned char str, RGBColor color)
 {
     auto packet = IO::set_led_matrix_character(*this, str, color, static_cast<uint8_t>(Processors::SECONDARY));
 
-    execute(packet);
+    return execute(packet);
 }
 
-void Sphero::save_compressed_frame(uint8_t index, std::vector<uint8_t> frame)
+int Sphero::save_compressed_frame(uint8_t index, std::vector<uint8_t> frame)
 {
     auto packet = IO::save_compressed_frame(*this, index, frame, static_cast<uint8_t>(Processors::SECONDARY));
 
-    execute(packet);
+    return execute(packet);
 }
 
 CommandResponse Sphero::save_compressed_frame_with_response(uint8_t index, std::vector<uint8_t> frame)
 {
     auto packet = IO::save_compressed_frame(*this, index, frame, static_cast<uint8_t>(Processors::SECONDARY));
 
-    execute(packet);
+    return execute_with_response(packet);
+}
 
-    return setup_response(packet);
+int Sphero::save_compressed_frame_async(uint8_t index, std::vector<uint8_t> frame, ResponseCallback callback, void* context)
+{
+    auto packet = IO::save_compressed_frame(*this, index, frame, static_cast<uint8_t>(Processors::SECONDARY));
+
+    return execute_async(packet, callback, context);
 }
 
-void Sphero::save_compressed_frame_animation(uint8_t fps, bool fade_animation, std::vector<RGBColor> palette, std::vector<uint16_t> frame_indexes)
+int Sphero::save_compressed_frame_animation(uint8_t fps, bool fade_animation, std::vector<RGBColor> palette, std::vector<uint16_t> frame_indexes)
 {
+    if (frame_indexes.size() > IO_MAX_ANIMATION_FRAMES || palette.size() > IO_MAX_PALETTE_COLORS) {
+        LOG_ERR("Animation of %zu frames and %zu colors doesn't fit in a packet", frame_indexes.size(), palette.size());
+        return -EMSGSIZE;
+    }
+
     auto packet = IO::save_compressed_frame_animation(*this, animation_index, fps, fade_animation, palette, frame_indexes, static_cast<uint8_t>(Processors::SECONDARY));
 
     animation_index++;
 
-    execute(packet);
+    return execute(packet);
 }
 
-void Sphero::register_matrix_animation(std::vector<std::vector<std::vector<uint8_t>>> frames, std::vector<RGBColor> palette, uint8_t fps, bool transition)
+int Sphero::register_matrix_animation(std::vector<std::vector<std::vector<uint8_t>>> frames, std::vector<RGBColor> palette, uint8_t fps, bool transition)
 {
+    // Checked before uploading any frames, which would otherwise be left unused
+    if (frames.size() > IO_MAX_ANIMATION_FRAMES || palette.size() > IO_MAX_PALETTE_COLORS) {
+        LOG_ERR("Animation of %zu frames and %zu colors doesn't fit in a packet", frames.size(), palette.size());
+        return -EMSGSIZE;
+    }
+
     std::vector<uint16_t> frame_indexes = {};
 
     for (auto frame : frames) {
@@ -240,30 +728,50 @@ void Sphero::register_matrix_animation(std::vector<std::vector<std::vector<uint8
         frame_index++;
     }
 
-    save_compressed_frame_animation(fps, transition, palette, frame_indexes);
+    return save_compressed_frame_animation(fps, transition, palette, frame_indexes);
 }
 
-void Sphero::play_animation(uint8_t animation_id, bool loop)
+int Sphero::play_animation(uint8_t animation_id, bool loop)
 {
     auto packet = IO::play_animation(*this, animation_id, loop, static_cast<uint8_t>(Processors::SECONDARY));
 
-    execute(packet);
+    return execute(packet);
 }
 
-void Sphero::clear_matrix()
+int Sphero::clear_matrix()
 {
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.matrix_color = RGBColor(0, 0, 0);
+    k_mutex_unlock(&state_lock);
+
     auto packet = IO::clear_matrix(*this, static_cast<uint8_t>(Processors::SECONDARY));
 
-    execute(packet);
+    return execute(packet);
 }
 
-void Sphero::set_all_leds_with_8_bit_mask(uint8_t mask, std::vector<uint8_t> led_values)
+int Sphero::set_all_leds_with_8_bit_mask(uint8_t mask, std::vector<uint8_t> led_values)
 {
+    size_t value = 0;
+
+    k_mutex_lock(&state_lock, K_FOREVER);
+
+    for (int i = 0; i < 8 && value < led_values.size(); i++) {
+        if (mask & (1 << i)) {
+            state.led_values[i] = led_values[value++];
+        }
+    }
+
+    state.led_mask |= mask;
+
+    k_mutex_unlock(&state_lock);
+
     auto packet = IO::set_all_leds_with_8_bit_mask(*this, mask, led_values, static_cast<uint8_t>(Processors::PRIMARY));
-    execute(packet);
+    packet.set_response_policy(ResponsePolicy::errors_only);
+
+    return execute(packet, BT_SPHERO_WRITE_WITHOUT_RSP);
 }
 
-void Sphero::set_all_leds_with_map(std::unordered_map<Sphero::LEDs, uint8_t> mapping)
+int Sphero::set_all_leds_with_map(std::unordered_map<Sphero::LEDs, uint8_t> mapping)
 {
     uint8_t mask = 0;
 
@@ -278,8 +786,10 @@ void Sphero::set_all_leds_with_map(std::unordered_map<Sphero::LEDs, uint8_t> map
     }
 
     if (mask != 0) {
-        set_all_leds_with_8_bit_mask(mask, led_values);
+        return set_all_leds_with_8_bit_mask(mask, led_values);
     }
+
+    return 0;
 }
 
 void Sphero::turn_off_all_leds()
@@ -310,58 +820,113 @@ Packet Sphero::get_drive_packet(uint8_t speed, uint16_t heading)
     return packet;
 }
 
-void Sphero::drive(uint8_t speed, uint16_t heading)
+int Sphero::drive(uint8_t speed, uint16_t heading)
 {
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.heading = heading;
+    k_mutex_unlock(&state_lock);
+
     auto packet = get_drive_packet(speed, heading);
+    packet.set_response_policy(ResponsePolicy::errors_only);
 
-    execute(packet);
+    return execute_latest(packet);
 }
 
 CommandResponse Sphero::drive_with_response(uint8_t speed, uint16_t heading)
 {
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.heading = heading;
+    k_mutex_unlock(&state_lock);
+
+    auto packet = get_drive_packet(speed, heading);
+
+    return execute_with_response(packet);
+}
+
+int Sphero::drive_async(uint8_t speed, uint16_t heading, ResponseCallback callback, void* context)
+{
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.heading = heading;
+    k_mutex_unlock(&state_lock);
+
     auto packet = get_drive_packet(speed, heading);
 
-    execute(packet);
+    return execute_async(packet, callback, context);
+}
+
+int Sphero::drive_with_retries(uint8_t speed, uint16_t heading, RetryCallback callback, void* context, uint8_t max_retries)
+{
+    k_mutex_lock(&state_lock, K_FOREVER);
+    state.heading = heading;
+    k_mutex_unlock(&state_lock);
+
+    return execute_with_retries([this, speed, heading]() { return get_drive_packet(speed, heading); }, callback, context, max_retries);
+}
 
-    return setup_response(packet);
+int Sphero::set_heading(uint16_t heading)
+{
+    return drive(0, heading);
 }
 
-void Sphero::set_heading(uint16_t heading)
+int Sphero::reset_aim()
 {
-    drive(0, heading);
+    auto packet = Drive::reset_aim(*this, static_cast<uint8_t>(Processors::SECONDARY));
+
+    return execute(packet);
 }
 
-void Sphero::reset_aim()
+int Sphero::reset_aim_async(ResponseCallback callback, void* context)
 {
     auto packet = Drive::reset_aim(*this, static_cast<uint8_t>(Processors::SECONDARY));
 
-    execute(packet);
+    return execute_async(packet, callback, context);
+}
+
+int Sphero::reset_aim_with_retries(RetryCallback callback, void* context, uint8_t max_retries)
+{
+    return execute_with_retries([this]() { return Drive::reset_aim(*this, static_cast<uint8_t>(Processors::SECONDARY)); }, callback, context, max_retries);
+}
+
+struct k_poll_signal* Sphero::get_response_signal(const CommandResponse& response)
+{
+    return response_table.signal(response);
+}
+
+void Sphero::release_response(const CommandResponse& response)
+{
+    response_table.release(response);
 }
 
 std::optional<Packet> Sphero::wait_for_response(const CommandResponse& response)
 {
-    int err = 0;
+    // A dead link is given up on as soon as the response is overdue for this Sphero
+    return wait_for_response(response, get_response_timeout_ms());
+}
 
-    err = k_poll(response.get(), 1, K_MSEC(10000));
+std::optional<Packet> Sphero::wait_for_response(const CommandResponse& response, uint32_t timeout_ms)
+{
+    int err = 0;
 
-    if (err) {
-        LOG_ERR("Failed to wait for response (err %d)", err);
+    if (!response.registered) {
+        LOG_ERR("No response registered for packet id %d", response.id);
         return std::nullopt;
     }
 
-    auto res = response.get()->signal->result;
+    struct k_poll_event event = K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, response_table.signal(response));
 
-    auto packet = responses.find(res);
+    err = k_poll(&event, 1, K_MSEC(timeout_ms));
 
-    if (packet == responses.end()) {
-        LOG_ERR("No packet for packet id %d", res);
+    if (err) {
+        LOG_ERR("Failed to wait for response (err %d)", err);
+        response_table.release(response);
         return std::nullopt;
     }
 
-    // Ideally this would be done in the handle_packet but doing it there causes signal to be destroyed so we
-    // cannot get back the id
-    waiting.erase(res);
-    responses.erase(res);
+    auto packet = response_table.take(response);
 
-    return packet->second;
-}
\ No newline at end of file
+    if (!packet) {
+        LOG_ERR("No packet for packet id %d", response.id);
+    }
+
+    return packet;
+}
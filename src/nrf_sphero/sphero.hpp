@@ -5,14 +5,68 @@
 #include "controls/packet.hpp"
 #include "controls/packet_collector.hpp"
 #include "controls/packet_manager.hpp"
+#include "controls/response_table.hpp"
 #include "utils/color.hpp"
+#include <functional>
 #include <memory>
 #include <optional>
 #include <unordered_map>
+#include <zephyr/sys/ring_buffer.h>
 
+/**
+ * Priority of the work queue which parses notifications and completes responses
+ */
 #define PACKET_PROCESSING_QUEUE_PRIORITY 4
 
-typedef std::unique_ptr<k_poll_event[]> CommandResponse;
+/**
+ * Stack size of the packet processing work queue
+ */
+#define PACKET_PROCESSING_STACK_SIZE 2048
+
+/**
+ * How often responses to async commands are checked for timeouts while any are outstanding
+ */
+#ifndef SPHERO_RESPONSE_SWEEP_MS
+#define SPHERO_RESPONSE_SWEEP_MS 20
+#endif
+
+/**
+ * Number of times an idempotent command is resent when its response doesn't arrive
+ */
+#ifndef SPHERO_MAX_RETRIES
+#define SPHERO_MAX_RETRIES 3
+#endif
+
+/**
+ * Number of idempotent async commands per Sphero which can be retrying at once
+ */
+#ifndef SPHERO_ASYNC_RETRY_COUNT
+#define SPHERO_ASYNC_RETRY_COUNT 4
+#endif
+
+/**
+ * Bytes of notifications per Sphero which can wait to be parsed. Notifications which don't fit are dropped
+ */
+#ifndef SPHERO_RX_RING_SIZE
+#define SPHERO_RX_RING_SIZE 512
+#endif
+
+/**
+ * Maximum number of commands per Sphero that can be waiting for a response
+ */
+#ifndef SPHERO_INFLIGHT_WINDOW
+#define SPHERO_INFLIGHT_WINDOW 8
+#endif
+
+/**
+ * @brief Called when a command executed with retries gets its response or gives up
+ *
+ * @param packet The response, nullptr unless err is 0. Only valid for the duration of the call
+ * @param err 0 if the response arrived, -ETIMEDOUT if no attempt was answered, or the error a resend failed with
+ * @param retries How many times the command was resent
+ * @param context Context given with the callback
+ */
+typedef void (*RetryCallback)(const PacketView* packet, int err, uint8_t retries, void* context);
 
 /**
  * This class specifically implements a Sphero BOLT
@@ -24,27 +78,151 @@ typedef std::unique_ptr<k_poll_event[]> CommandResponse;
 
 class Sphero {
 private:
-    /** @brief The id of the Sphero Context */
+    /** @brief The id of the Sphero, the index of its name in the names given to the scanner */
     uint8_t sphero_id;
 
+    /** @brief Registry slot of the Sphero, looked up once so sends don't need to */
+    struct sphero_slot* slot;
+
     /** @brief The index of the next animation frame */
     uint16_t frame_index;
 
     /** @brief The index of the next animation */
     uint8_t animation_index;
 
+    /** @brief Whether the Sphero has answered a wake command since it last connected */
+    atomic_t ready = ATOMIC_INIT(0);
+
+    /** @brief Packets dropped because no TX buffer was free */
+    atomic_t tx_alloc_failures = ATOMIC_INIT(0);
+
     /**
-     * @brief Subscribe to notifications from the Sphero
+     * @brief Notifications waiting to be parsed
+     *
+     * Only the BT RX thread puts and only the packet processing work queue gets, so no locking is needed
+     */
+    struct ring_buf rx_ring;
+    uint8_t rx_ring_data[SPHERO_RX_RING_SIZE];
+
+    /** @brief Notifications dropped because rx_ring was full */
+    atomic_t rx_overflows = ATOMIC_INIT(0);
+
+    /** @brief Idempotent commands resent, and how many gave up after every retry */
+    atomic_t retries = ATOMIC_INIT(0);
+    atomic_t lost_commands = ATOMIC_INIT(0);
+
+    /** @brief Drains rx_ring on the packet processing work queue */
+    struct RxWork {
+        struct k_work work;
+        Sphero* sphero;
+    } rx_work;
+
+    static void rx_work_handler(struct k_work* work);
+
+    /** @brief Times out async commands on the packet processing work queue, see execute_async */
+    struct SweepWork {
+        struct k_work_delayable work;
+        Sphero* sphero;
+    } sweep_work;
+
+    static void sweep_work_handler(struct k_work* work);
+
+    /**
+     * @brief An idempotent async command which is resent until its response arrives, see execute_with_retries
+     *
+     * Resends go through the system work queue since sending can wait for a TX buffer, which the response callback
+     * on the packet processing work queue mustn't
+     */
+    struct RetryWork {
+        struct k_work work;
+        Sphero* sphero;
+        /** @brief Set while in use */
+        atomic_t busy;
+        /** @brief Index into retry_works and retry_packets */
+        uint8_t index;
+        RetryCallback callback;
+        void* context;
+        uint8_t attempt;
+        uint8_t max_retries;
+    } retry_works[SPHERO_ASYNC_RETRY_COUNT];
+
+    /** @brief Creates each attempt of the command in the matching retry_works entry. Kept apart so RetryWork can be
+     *         found from its k_work */
+    std::function<Packet()> retry_packets[SPHERO_ASYNC_RETRY_COUNT];
+
+    static void retry_work_handler(struct k_work* work);
+
+    /**
+     * @brief Response callback of every attempt, which schedules a resend or hands the outcome to the caller
+     */
+    static void retry_response(const PacketView* packet, int err, void* context);
+
+    /**
+     * @brief Send the current attempt of a retrying command
+     */
+    int retry_send(RetryWork* retry);
+
+    /**
+     * @brief Free a retrying command and call its callback
+     */
+    static void retry_finish(RetryWork* retry, const PacketView* packet, int err);
+
+    /**
+     * @brief Subscribe to notifications from the Sphero, now and on every reconnect
      */
     void subscribe();
 
     /**
-     * @brief Static wrapper for the handle_recevied_data function
+     * @brief Static wrapper which queues notifications for the packet processing work queue
      *
      * @note This is required since the callback function must be static to be passed to the C API
+     * @note Runs on the BT RX thread so only copies the data into rx_ring
      */
     static bt_sphero_received_cb_t received_cb_wrapper;
 
+    /**
+     * @brief Called by the scanner from the BT RX thread when the Sphero has (re)connected
+     */
+    static void connected_cb_wrapper(uint8_t id, void* context);
+
+    /**
+     * @brief Guards state and latest_response, which the thread sending commands, the replay work and response
+     *        callbacks on the packet processing work queue all touch
+     */
+    struct k_mutex state_lock;
+
+    /**
+     * @brief Last state sent to the Sphero, replayed after a reconnect
+     */
+    struct State {
+        std::optional<RGBColor> matrix_color;
+        /** @brief Which LEDs have been set, same bits as set_all_leds_with_8_bit_mask */
+        uint8_t led_mask = 0;
+        uint8_t led_values[8] = {};
+        std::optional<uint16_t> heading;
+        std::optional<bool> locator_flags;
+    } state;
+
+    /**
+     * @brief Work item which replays state on the system work queue, since the scanner callback can't send
+     */
+    struct ReplayWork {
+        struct k_work work;
+        Sphero* sphero;
+    } replay_work;
+
+    static void replay_work_handler(struct k_work* work);
+
+    /**
+     * @brief Wake the Sphero and send it the last known state
+     */
+    void replay_state();
+
+    /**
+     * @brief Marks the Sphero as ready once it answers the wake sent by replay_state
+     */
+    static void replay_woken(const PacketView* packet, int err, void* context);
+
     /**
      * @brief Tracks recieved packets and calls the callback function when a complete packet is received
      */
@@ -55,23 +233,53 @@ private:
      *
      * @note This function is called when a complete packet is received
      */
-    void handle_packet(Packet packet);
+    void handle_packet(const PacketView& packet);
 
     /**
-     * @brief Handle setting up signals to wait for response
+     * @brief Encode a packet into a TX buffer and enqueue it on the Sphero's connection
+     *
+     * Returns once the packet is queued, the TX work queue writes it to the Sphero
+     *
+     * @param[in] mode Whether each write waits for a link-level Write Response
+     *
+     * @retval 0 If successful
+     *         Otherwise, a negative error code is returned
+     */
+    int transmit(const Packet& packet, bt_sphero_write_mode mode, bool test);
+
+    /**
+     * @brief Encode a packet into a TX buffer from the pool
+     *
+     * @param[in] mode Whether each write waits for a link-level Write Response
+     *
+     * @retval bt_sphero_tx_buf* The buffer, or nullptr if there were no free buffers or the packet didn't fit
      */
-    CommandResponse setup_response(const Packet& packet);
+    bt_sphero_tx_buf* encode_tx_buf(const Packet& packet, bt_sphero_write_mode mode);
 
     /**
-     * @brief Map of packet keys to queues of k_poll_signals which are used to pass packet response back
-     * to executing function
+     * @brief Send a packet through the latest-wins slot, replacing the previous one if it hasn't been sent yet
+     *
+     * Like execute, only a full response holds a credit of the in-flight window
+     *
+     * @retval 0 If successful
+     *         Otherwise, a negative error code is returned
+     */
+    int execute_latest(const Packet& packet);
+
+    /**
+     * @brief Wait for a response for at most timeout_ms
      */
-    std::unordered_map<uint32_t, std::shared_ptr<struct k_poll_signal>> waiting;
+    std::optional<Packet> wait_for_response(const CommandResponse& response, uint32_t timeout_ms);
 
     /**
-     * @brief Map of packet keys to packets which are used to pass packet response back
+     * @brief Response slot of the packet in the latest-wins slot, released if that packet gets replaced
      */
-    std::unordered_map<uint32_t, Packet> responses;
+    CommandResponse latest_response = {};
+
+    /**
+     * @brief Commands waiting for a response, indexed by sequence number. Also limits how many can be in flight
+     */
+    ResponseTable response_table;
 
     /**
      * @brief Creates packet to tell Sphero to drive with speed in heading
@@ -103,17 +311,163 @@ public:
         LAST
     };
 
+    /**
+     * @brief Statistics of the link to the Sphero, see get_link_stats
+     */
+    struct LinkStats {
+        /** @brief Whether the Sphero is connected. Only the Sphero's own counters are set if not */
+        bool connected;
+
+        /** @brief RSSI of the connection in dBm, 0 if it couldn't be read */
+        int8_t rssi;
+
+        /** @brief Counters and parameters of the current connection */
+        bt_sphero_client_stats link;
+
+        /** @brief Packets from the Sphero which failed to parse, since the Sphero was created */
+        uint32_t parse_errors;
+
+        /** @brief Packets dropped because no TX buffer was free, since the Sphero was created */
+        uint32_t tx_alloc_failures;
+
+        /** @brief Notifications dropped because they were received faster than they could be parsed */
+        uint32_t rx_overflows;
+
+        /** @brief Smoothed round trip time of responses and its variance */
+        uint32_t srtt_ms;
+        uint32_t rttvar_ms;
+
+        /** @brief How long a response is currently waited for, see get_response_timeout_ms */
+        uint32_t response_timeout_ms;
+
+        /** @brief Commands waiting for a response, see get_in_flight */
+        uint32_t in_flight;
+
+        /** @brief Free buffers in the TX pool shared by every Sphero */
+        uint32_t tx_bufs_free;
+
+        /** @brief Idempotent commands resent, and how many got no response after every retry */
+        uint32_t retries;
+        uint32_t lost_commands;
+
+        /** @brief Times sending stalled, and how many of those dropped the connection, since scanning started */
+        uint32_t stalls;
+        uint32_t stall_disconnects;
+    };
+
     /**
      * @brief Execute a command
      *
+     * @param[in] packet The command to execute
+     * @param[in] mode BT_SPHERO_WRITE_WITHOUT_RSP for fire-and-forget commands that don't need link-level acks
+     * @param[in] test If true the packet is encoded but not sent
+     *
      * @note Differs from Sphero v2 since doesn't add to a queue
+     * @note If the command requests a full response it holds a credit of the in-flight window until the response
+     *       arrives. Commands with ResponsePolicy::errors_only or none don't, since on success nothing comes back
+     *
+     * @retval 0 If successful
+     * @retval -EBUSY If SPHERO_INFLIGHT_WINDOW commands are already waiting for a response
+     *         Otherwise, a negative error code is returned
+     */
+    int execute(const Packet& packet, bt_sphero_write_mode mode = BT_SPHERO_WRITE_WITH_RSP, bool test = false);
+
+    /**
+     * @brief Execute a command without waiting for its response
+     *
+     * The callback is called on the packet processing work queue with the response, or with -ETIMEDOUT if it hasn't
+     * arrived within timeout_ms. The callback shouldn't block for long, since it holds up the parsing of every
+     * Sphero's packets, so send any follow-up command from a work item since sending can wait for a TX buffer
+     *
+     * @param packet The command to execute. Must request a full response, which new packets do
+     * @param callback Called with the response or the timeout. Not called if this returns an error
+     * @param context Passed to the callback
+     * @param timeout_ms How long to wait for the response, 0 for get_response_timeout_ms
+     *
+     * @retval 0 If the command was sent
+     * @retval -EBUSY If SPHERO_INFLIGHT_WINDOW commands are already waiting for a response
+     *         Otherwise, a negative error code is returned
+     */
+    int execute_async(const Packet& packet, ResponseCallback callback, void* context, uint32_t timeout_ms = 0);
+
+    /**
+     * @brief Execute an idempotent command without waiting for its response, resending it until the response arrives
+     *
+     * Each attempt waits for the response with a timeout from the round trip estimate, doubled for every retry. A
+     * lost attempt is resent as a new packet with a fresh sequence number, so a late response to an earlier attempt
+     * can't be mistaken for the new one. Only use for commands which have the same effect however often they run
+     *
+     * The callback is called once, like execute_async's, with how many retries were needed and -ETIMEDOUT only after
+     * every retry. If a resend can't be sent it's called with that error from the system work queue instead
+     *
+     * @param make_packet Creates the packet, called once per attempt
+     * @param callback Called with the response or the timeout. Not called if this returns an error
+     * @param context Passed to the callback
+     * @param max_retries How many times to resend the command
+     *
+     * @retval 0 If the command was sent
+     * @retval -EBUSY If SPHERO_ASYNC_RETRY_COUNT commands are already retrying or SPHERO_INFLIGHT_WINDOW commands are
+     *         already waiting for a response
+     *         Otherwise, a negative error code is returned
+     */
+    int execute_with_retries(const std::function<Packet()>& make_packet, RetryCallback callback, void* context, uint8_t max_retries = SPHERO_MAX_RETRIES);
+
+    /**
+     * @brief Execute a command and register its response to wait on
+     *
+     * @note The packet must request a full response, which new packets do
+     *
+     * @retval CommandResponse The response to wait for. registered is false if the command couldn't be sent
      */
-    void execute(const Packet& packet, bool test = false);
+    CommandResponse execute_with_response(const Packet& packet);
+
+    /**
+     * @brief Get the number of commands waiting for a response
+     */
+    size_t get_in_flight();
+
+    /**
+     * @brief Get the id of the Sphero
+     */
+    uint8_t get_id();
+
+    /**
+     * @brief Whether the Sphero has answered a wake command since it was connected
+     */
+    bool is_ready();
+
+    /**
+     * @brief Get how long to wait for a response from the Sphero
+     *
+     * Comes from the round trip of previous responses, bounded by RTT_MIN_TIMEOUT_MS and RTT_MAX_TIMEOUT_MS
+     */
+    uint32_t get_response_timeout_ms();
+
+    /**
+     * @brief Get the statistics of the link to the Sphero
+     *
+     * @note Reads the RSSI from the controller so blocks briefly
+     */
+    LinkStats get_link_stats();
+
+    /**
+     * @brief Finish bringing up the Sphero once the response to wake_with_response has arrived
+     *
+     * Marks the Sphero as ready and turns off its LEDs
+     *
+     * @param response The response to wake_with_response
+     *
+     * @retval 0 If successful
+     * @retval -EAGAIN If the response hasn't arrived
+     */
+    int finish_wake(const CommandResponse& response);
 
     /**
      * @brief Wake up Sphero from soft sleep. Nothing to do if awake.
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void wake();
+    int wake();
 
     /**
      * @brief Wake up Sphero from soft sleep. Nothing to do if awake.
@@ -126,8 +480,10 @@ public:
      * @brief Sets flags for the locator module.
      *
      * @param locator_flags The flags to set
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void set_locator_flags(bool locator_flags);
+    int set_locator_flags(bool locator_flags);
 
     /**
      * @brief Fills a given region of Sphero BOLT's 8x8 matrix a specific color
@@ -137,31 +493,51 @@ public:
      * @param x2 The x coordinate of the second corner
      * @param y2 The y coordinate of the second corner
      * @param color The color to set matrix to
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void set_matrix_fill(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, RGBColor color);
+    int set_matrix_fill(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, RGBColor color);
 
     /**
      * @brief Sets Sphero BOLT's LED matrix to specified color
      *
      * @param color The color to set matrix to
+     *
+     * @retval 0 If successful, otherwise the error from execute
+     */
+    int set_matrix_color(RGBColor color);
+
+    /**
+     * @brief Set the color of the LED matrix, resending the command until the Sphero answers, see execute_with_retries
+     *
+     * @param[in] color The color to set
+     * @param[in] callback Called with the response or the timeout, and how many retries it took
+     * @param[in] context Passed to the callback
+     * @param[in] max_retries How many times to resend the command
+     *
+     * @retval 0 If successful, otherwise the error from execute_with_retries
      */
-    void set_matrix_color(RGBColor color);
+    int set_matrix_color_with_retries(RGBColor color, RetryCallback callback, void* context, uint8_t max_retries = SPHERO_MAX_RETRIES);
 
     /**
      * @brief Set indivudal pixel on Sphero BOLT's LED matrix to specified color
      * @param[in] x The x coordinate of the pixel
      * @param[in] y The y coordinate of the pixel
      * @param[in] color The color to set the pixel to
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void set_matrix_pixel_color(uint8_t x, uint8_t y, RGBColor color);
+    int set_matrix_pixel_color(uint8_t x, uint8_t y, RGBColor color);
 
     /**
      * @brief Display character on Sphero BOLT's LED matrix
      *
      * @param[in] char The character to display
      * @param[in] color The color to set the pixel to
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void set_matrix_character(unsigned char str, RGBColor color);
+    int set_matrix_character(unsigned char str, RGBColor color);
 
     /**
      * @brief Registers a matrix animation
@@ -170,16 +546,22 @@ public:
      * @param[in] palette is a list of colors
      * @param[in] fps
      * @param[in] transition to true if fade between frames
+     *
+     * @retval 0 If successful
+     * @retval -EMSGSIZE If there are more than IO_MAX_ANIMATION_FRAMES frames or IO_MAX_PALETTE_COLORS colors
+     *         Otherwise, the error from save_compressed_frame_animation
      */
-    void register_matrix_animation(std::vector<std::vector<std::vector<uint8_t>>> frames, std::vector<RGBColor> palette, uint8_t fps, bool transition);
+    int register_matrix_animation(std::vector<std::vector<std::vector<uint8_t>>> frames, std::vector<RGBColor> palette, uint8_t fps, bool transition);
 
     /**
      * @brief Saves a compressed frame with a specified index
      *
      * @param[in] index The index of the frame
      * @param[in] frame The frame to save
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void save_compressed_frame(uint8_t index, std::vector<uint8_t> frame);
+    int save_compressed_frame(uint8_t index, std::vector<uint8_t> frame);
 
     /**
      * @brief Saves a compressed frame with a specified index
@@ -191,6 +573,18 @@ public:
      */
     CommandResponse save_compressed_frame_with_response(uint8_t index, std::vector<uint8_t> frame);
 
+    /**
+     * @brief Saves a compressed frame with a specified index without waiting for the Sphero, see execute_async
+     *
+     * @param[in] index The index of the frame
+     * @param[in] frame The frame to save
+     * @param[in] callback Called with the response or the timeout
+     * @param[in] context Passed to the callback
+     *
+     * @retval 0 If successful, otherwise the error from execute_async
+     */
+    int save_compressed_frame_async(uint8_t index, std::vector<uint8_t> frame, ResponseCallback callback, void* context);
+
     /**
      * @brief Save an animation
      *
@@ -198,35 +592,47 @@ public:
      * @param[in] fade_animation Whether or not to fade between frames
      * @param[in] palette The palette of colors to use
      * @param[in] frame_indexes The indexes of frames in the animation
+     *
+     * @retval 0 If successful
+     * @retval -EMSGSIZE If there are more than IO_MAX_ANIMATION_FRAMES frames or IO_MAX_PALETTE_COLORS colors
+     *         Otherwise, the error from execute
      */
-    void save_compressed_frame_animation(uint8_t fps, bool fade_animation, std::vector<RGBColor> palette, std::vector<uint16_t> frame_indexes);
+    int save_compressed_frame_animation(uint8_t fps, bool fade_animation, std::vector<RGBColor> palette, std::vector<uint16_t> frame_indexes);
 
     /**
      * @brief Play an animation
      *
      * @param[in] animation_id The id of the animation
      * @param[in] loop Whether or not to loop the animation
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void play_animation(uint8_t animation_id, bool loop = true);
+    int play_animation(uint8_t animation_id, bool loop = true);
 
     /**
      * @brief Clears animation from LED matrix
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void clear_matrix();
+    int clear_matrix();
 
     /**
      * @brief Sets all the LEDs on Sphero BOLT with a 8 bit mask
      *
      * @param mask The 8 bit mask to set the LEDs with
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void set_all_leds_with_8_bit_mask(uint8_t mask, std::vector<uint8_t> led_values);
+    int set_all_leds_with_8_bit_mask(uint8_t mask, std::vector<uint8_t> led_values);
 
     /**
      * @brief Sets LEDs from a map
      *
      * @param mapping The mapping of LEDs to values
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void set_all_leds_with_map(std::unordered_map<LEDs, uint8_t> mapping);
+    int set_all_leds_with_map(std::unordered_map<LEDs, uint8_t> mapping);
 
     /**
      * @brief Turns off all LEDs on Sphero BOLT
@@ -242,8 +648,11 @@ public:
      * @param[in] heading The heading to drive at
      * 
      * @note Sphero Logo is the front of the robot. 0° is forward, 90° is right, 270° is left, and 180° is backward.
+     * @note Latest wins: a drive command which hasn't been sent yet is replaced by this one
+     *
+     * @retval 0 If successful, otherwise the error from execute_latest
      */
-    void drive(uint8_t speed, uint16_t heading);
+    int drive(uint8_t speed, uint16_t heading);
 
     /**
      * @brief Drive the sphero
@@ -257,6 +666,31 @@ public:
      */
     CommandResponse drive_with_response(uint8_t speed, uint16_t heading);
 
+    /**
+     * @brief Drive the sphero without waiting for the Sphero, see execute_async
+     *
+     * @param[in] speed The speed to drive at
+     * @param[in] heading The heading to drive at
+     * @param[in] callback Called with the response or the timeout
+     * @param[in] context Passed to the callback
+     *
+     * @retval 0 If successful, otherwise the error from execute_async
+     */
+    int drive_async(uint8_t speed, uint16_t heading, ResponseCallback callback, void* context);
+
+    /**
+     * @brief Drive the sphero, resending the command until the Sphero answers, see execute_with_retries
+     *
+     * @param[in] speed The speed to drive at
+     * @param[in] heading The heading to drive at
+     * @param[in] callback Called with the response or the timeout, and how many retries it took
+     * @param[in] context Passed to the callback
+     * @param[in] max_retries How many times to resend the command
+     *
+     * @retval 0 If successful, otherwise the error from execute_with_retries
+     */
+    int drive_with_retries(uint8_t speed, uint16_t heading, RetryCallback callback, void* context, uint8_t max_retries = SPHERO_MAX_RETRIES);
+
     /**
      * @brief Sets the direction the robot will drive in
      *
@@ -264,24 +698,65 @@ public:
      * 270° is left, and 180° is backward.
      *
      * @param[in] heading The heading to drive at
+     *
+     * @retval 0 If successful, otherwise the error from execute
      */
-    void set_heading(uint16_t heading);
+    int set_heading(uint16_t heading);
 
     /**
      * @brief Reset aim
      *
      * @note Resets the heading calibration (aim) angle to use the current direction of the robot as 0°
+     *
+     * @retval 0 If successful, otherwise the error from execute
+     */
+    int reset_aim();
+
+    /**
+     * @brief Reset aim without waiting for the Sphero, see execute_async
+     *
+     * @param[in] callback Called with the response or the timeout
+     * @param[in] context Passed to the callback
+     *
+     * @retval 0 If successful, otherwise the error from execute_async
+     */
+    int reset_aim_async(ResponseCallback callback, void* context);
+
+    /**
+     * @brief Reset aim, resending the command until the Sphero answers, see execute_with_retries
+     *
+     * @param[in] callback Called with the response or the timeout, and how many retries it took
+     * @param[in] context Passed to the callback
+     * @param[in] max_retries How many times to resend the command
+     *
+     * @retval 0 If successful, otherwise the error from execute_with_retries
      */
-    void reset_aim();
+    int reset_aim_with_retries(RetryCallback callback, void* context, uint8_t max_retries = SPHERO_MAX_RETRIES);
 
     /**
      * @brief Wait for a packet to be resolved
      *
+     * Waits for at most get_response_timeout_ms
+     *
      * @param response The response to wait for
      *
      * @retval std::optional<Packet> The packet if it was received
      */
     std::optional<Packet> wait_for_response(const CommandResponse& response);
+
+    /**
+     * @brief Get the signal raised when a response arrives, to wait on several responses at once with k_poll
+     *
+     * @param response The response to wait for
+     */
+    struct k_poll_signal* get_response_signal(const CommandResponse& response);
+
+    /**
+     * @brief Stop waiting for a response and free its slot
+     *
+     * @param response The response to give up on
+     */
+    void release_response(const CommandResponse& response);
 };
 
 #endif // SPHERO_H
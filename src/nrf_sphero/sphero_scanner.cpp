@@ -54,6 +54,31 @@ bool SpheroScanner::found_all_spheros(uint64_t timeout)
     return false;
 }
 
+bool SpheroScanner::wait_for_all_spheros(uint64_t timeout)
+{
+    for (;;) {
+        int64_t remaining = last_sphero_found + timeout - k_uptime_get();
+
+        if (remaining <= 0) {
+            return false;
+        }
+
+        // last_sphero_found moves on every time a sphero is found so wake up and check again when this expires
+        if (scanner_wait_for_all(K_MSEC(remaining)) == 0) {
+            return true;
+        }
+    }
+}
+
+std::vector<std::string> SpheroScanner::get_missing_spheros()
+{
+    const char* missing[CONFIG_BT_MAX_CONN];
+
+    int count = scanner_get_missing(missing, CONFIG_BT_MAX_CONN);
+
+    return std::vector<std::string>(missing, missing + count);
+}
+
 unsigned int SpheroScanner::get_num_spheros()
 {
     return scanner_get_sphero_count();
@@ -61,7 +86,9 @@ unsigned int SpheroScanner::get_num_spheros()
 
 std::vector<std::shared_ptr<Sphero>> SpheroScanner::get_spheros()
 {
-    unsigned int num_spheros = scanner_get_sphero_count();
+    // One per name, in the order they were given, so ids stay the same across reconnects. Spheros which aren't
+    // connected yet are bound when they connect
+    unsigned int num_spheros = scanner_get_name_count();
 
     std::vector<std::shared_ptr<Sphero>> spheros;
     for (size_t i = 0; i < num_spheros; i++) {
@@ -4,6 +4,7 @@
 #include "sphero.hpp"
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <vector>
 
 class SpheroScanner {
@@ -38,6 +39,21 @@ public:
      */
     bool found_all_spheros(uint64_t timeout = 5000);
 
+    /** @brief Wait until every named sphero has connected and finished discovery
+     *
+     * Returns as soon as the last sphero is found. Falls back to giving up once no sphero has been found for timeout
+     *
+     * @param[in] timeout How long to wait after last Sphero found in milliseconds
+     * @returns True if all spheros have been found, false if the timeout expired first
+     */
+    bool wait_for_all_spheros(uint64_t timeout = 5000);
+
+    /** @brief Get the names of the spheros which haven't been found yet
+     *
+     * @returns The missing names
+     */
+    std::vector<std::string> get_missing_spheros();
+
     /**
      * @brief Get the number of spheros found
      *
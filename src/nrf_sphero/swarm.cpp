@@ -0,0 +1,198 @@
+#include "swarm.hpp"
+#include "ble/scanner.h"
+#include "ble/sphero_client.h"
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(Swarm, LOG_LEVEL_DBG);
+
+Swarm::Swarm(std::vector<std::shared_ptr<Sphero>> spheros)
+    : spheros(spheros)
+{
+}
+
+std::vector<int> Swarm::execute(const Command& command, int32_t timeout_ms)
+{
+    const size_t count = spheros.size();
+
+    std::vector<int> results(count, 0);
+    std::vector<sphero_slot*> slots(count, nullptr);
+    std::vector<bt_sphero_client*> clients(count, nullptr);
+    std::vector<uint32_t> targets(count, 0);
+    std::vector<k_poll_event> events(count);
+    std::vector<size_t> waiting;
+
+    // Fan out: queueing doesn't wait for the link so every connection starts sending straight away
+    for (size_t i = 0; i < count; i++) {
+        slots[i] = scanner_get_slot(spheros[i]->get_id());
+        clients[i] = scanner_slot_acquire(slots[i]);
+
+        if (clients[i] == nullptr) {
+            results[i] = -ENOTCONN;
+            continue;
+        }
+
+        k_poll_signal_reset(&clients[i]->tx_signal);
+
+        results[i] = command(*spheros[i], i);
+
+        if (results[i] == 0) {
+            targets[i] = bt_sphero_client_tx_enqueued(clients[i]);
+            waiting.push_back(i);
+        }
+    }
+
+    // Fan in: wait on every link at once until all have sent or the deadline passes
+    int64_t deadline = k_uptime_get() + timeout_ms;
+
+    while (!waiting.empty()) {
+        size_t n = 0;
+
+        for (auto it = waiting.begin(); it != waiting.end();) {
+            // Disconnected, what's left in its queue is dropped once the client is released below
+            if (bt_sphero_client_tx_closed(clients[*it])) {
+                results[*it] = -ENOTCONN;
+                it = waiting.erase(it);
+                continue;
+            }
+
+            // Counters are wrapping so compare the difference
+            if ((int32_t)(bt_sphero_client_tx_completed(clients[*it]) - targets[*it]) >= 0) {
+                it = waiting.erase(it);
+                continue;
+            }
+
+            k_poll_event_init(&events[n++], K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, &clients[*it]->tx_signal);
+            ++it;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        int64_t remaining = deadline - k_uptime_get();
+
+        if (remaining <= 0 || k_poll(events.data(), n, K_MSEC(remaining)) == -EAGAIN) {
+            for (size_t i : waiting) {
+                if ((int32_t)(bt_sphero_client_tx_completed(clients[i]) - targets[i]) < 0) {
+                    results[i] = -ETIMEDOUT;
+                }
+            }
+
+            break;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (events[i].state == K_POLL_STATE_SIGNALED) {
+                k_poll_signal_reset(events[i].signal);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (clients[i] != nullptr) {
+            scanner_slot_release(slots[i]);
+        }
+
+        if (results[i]) {
+            LOG_WRN("Sphero %d: command failed (err %d)", i, results[i]);
+        }
+    }
+
+    return results;
+}
+
+std::vector<int> Swarm::wake(int32_t timeout_ms, const ReadyCallback& on_ready)
+{
+    const size_t count = spheros.size();
+
+    std::vector<int> results(count, 0);
+    std::vector<CommandResponse> responses(count, CommandResponse {});
+    std::vector<k_poll_event> events(count);
+    std::vector<size_t> waiting;
+
+    // Phase 1: send wake to every Sphero
+    for (size_t i = 0; i < count; i++) {
+        if (spheros[i]->is_ready()) {
+            continue;
+        }
+
+        responses[i] = spheros[i]->wake_with_response();
+
+        if (!responses[i].registered) {
+            results[i] = -EIO;
+            continue;
+        }
+
+        waiting.push_back(i);
+    }
+
+    // Phase 2: wait on every response at once
+    int64_t deadline = k_uptime_get() + timeout_ms;
+
+    while (!waiting.empty()) {
+        size_t n = 0;
+
+        for (size_t i : waiting) {
+            k_poll_event_init(&events[n++], K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, spheros[i]->get_response_signal(responses[i]));
+        }
+
+        int64_t remaining = deadline - k_uptime_get();
+
+        if (remaining <= 0 || k_poll(events.data(), n, K_MSEC(remaining)) == -EAGAIN) {
+            break;
+        }
+
+        // Response signals are raised once so there's nothing to reset
+        n = 0;
+
+        for (auto it = waiting.begin(); it != waiting.end(); n++) {
+            if (events[n].state != K_POLL_STATE_SIGNALED) {
+                ++it;
+                continue;
+            }
+
+            results[*it] = spheros[*it]->finish_wake(responses[*it]);
+
+            LOG_INF("Sphero %d is ready (%d of %d)", *it, ready_count(), count);
+
+            if (results[*it] == 0 && on_ready) {
+                on_ready(*it);
+            }
+
+            it = waiting.erase(it);
+        }
+    }
+
+    for (size_t i : waiting) {
+        LOG_WRN("Sphero %d didn't wake up", i);
+
+        spheros[i]->release_response(responses[i]);
+        results[i] = -ETIMEDOUT;
+    }
+
+    return results;
+}
+
+size_t Swarm::ready_count()
+{
+    size_t ready = 0;
+
+    for (auto& sphero : spheros) {
+        if (sphero->is_ready()) {
+            ready++;
+        }
+    }
+
+    return ready;
+}
+
+size_t Swarm::size()
+{
+    return spheros.size();
+}
+
+std::shared_ptr<Sphero> Swarm::operator[](size_t index)
+{
+    return spheros[index];
+}
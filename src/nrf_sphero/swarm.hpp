@@ -0,0 +1,97 @@
+#ifndef SWARM_H
+#define SWARM_H
+
+#include "sphero.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * Default time to wait for a command to be sent to every Sphero
+ */
+#define SWARM_TIMEOUT_MS 500
+
+/**
+ * Default time to wait for every Sphero to answer a wake command
+ */
+#define SWARM_WAKE_TIMEOUT_MS RESPONSE_TIMEOUT_MS
+
+/**
+ * Sends the same logical command to every Sphero at once
+ *
+ * The command is queued on every connection first and then the links are waited on together, so a swarm-wide update
+ * takes about as long as the slowest link rather than the sum of all of them.
+ */
+class Swarm {
+private:
+    std::vector<std::shared_ptr<Sphero>> spheros;
+
+public:
+    /**
+     * @param spheros The connected Spheros, as returned by SpheroScanner::get_spheros
+     */
+    Swarm(std::vector<std::shared_ptr<Sphero>> spheros);
+
+    /**
+     * @brief A command for one Sphero
+     *
+     * @param[in] sphero The Sphero to send to
+     * @param[in] index The index of the Sphero in the swarm
+     *
+     * @retval 0 If the command was queued, otherwise a negative error code
+     */
+    typedef std::function<int(Sphero& sphero, size_t index)> Command;
+
+    /**
+     * @brief Queue a command on every Sphero and wait until every link has sent it
+     *
+     * @param[in] command Called once per Sphero. May send several packets
+     * @param[in] timeout_ms How long to wait for all links
+     *
+     * @retval std::vector<int> Per Sphero, 0 if sent, -ETIMEDOUT if the link didn't send it in time or the error
+     *                          from queueing the command
+     */
+    std::vector<int> execute(const Command& command, int32_t timeout_ms = SWARM_TIMEOUT_MS);
+
+    /**
+     * @brief Called as soon as a Sphero is ready, see wake
+     *
+     * @param[in] index The index of the Sphero in the swarm
+     */
+    typedef std::function<void(size_t index)> ReadyCallback;
+
+    /**
+     * @brief Wake every Sphero that isn't ready yet and wait for their responses together
+     *
+     * Wake is sent to every Sphero first, then all the responses are waited on with a single k_poll. Spheros are
+     * marked ready as their responses arrive, so the ones that answered can be used even if others didn't
+     *
+     * @param[in] timeout_ms How long to wait for all responses
+     * @param[in] on_ready Called as each Sphero becomes ready, so progress can be reported before the deadline.
+     *                     May be empty
+     *
+     * @retval std::vector<int> Per Sphero, 0 if ready, -ETIMEDOUT if it didn't answer in time or the error from sending
+     *                          wake
+     */
+    std::vector<int> wake(int32_t timeout_ms = SWARM_WAKE_TIMEOUT_MS, const ReadyCallback& on_ready = nullptr);
+
+    /**
+     * @brief Get the number of Spheros which are ready
+     */
+    size_t ready_count();
+
+    /**
+     * @brief Get the number of Spheros in the swarm
+     */
+    size_t size();
+
+    /**
+     * @brief Get a Sphero
+     *
+     * @param[in] index The index of the Sphero in the swarm
+     */
+    std::shared_ptr<Sphero> operator[](size_t index);
+};
+
+#endif // SWARM_H